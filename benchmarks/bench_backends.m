@@ -0,0 +1,39 @@
+%% Per-operation latency of the ioctl (ppdev) and ioport (inb/outb) backends
+% The 'ioport' backend needs root (or CAP_SYS_RAWIO) for ioperm.
+% The times include the MEX call itself, the difference between the backends is the cost of the ioctl.
+
+clear all % to be sure to clean all MEX files
+clc
+
+port = '/dev/parport1';
+n_ops = 1e5;
+backends = {'ioctl', 'ioport'};
+
+for b = 1:numel(backends)
+    if strcmp(backends{b}, 'ioport')
+        ppMEG('open', port, 'ioport');
+    else
+        ppMEG('open', port);
+    end
+
+    % write: alternate two values so that every call changes the DATA pins
+    dt_write = zeros(n_ops, 1);
+    for k = 1:n_ops
+        t0 = tic;
+        ppMEG('w', mod(k, 2) * 255);
+        dt_write(k) = toc(t0);
+    end
+    ppMEG('w', 0);
+
+    dt_read = zeros(n_ops, 1);
+    for k = 1:n_ops
+        t0 = tic;
+        value = ppMEG('r');
+        dt_read(k) = toc(t0);
+    end
+
+    ppMEG('c');
+
+    fprintf('%-6s : write median %.2f us (p99 %.2f us) | read median %.2f us (p99 %.2f us)\n', backends{b}, ...
+            1e6 * median(dt_write), 1e6 * prctile(dt_write, 99), 1e6 * median(dt_read), 1e6 * prctile(dt_read, 99));
+end
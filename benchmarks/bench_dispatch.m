@@ -0,0 +1,35 @@
+%% Cost of a ppMEG call and memory growth over 10^6 triggers
+% Uses the simulated ports (no access latency), so that only the MEX call and the dispatch are measured.
+% The resident memory of MATLAB is read in /proc/self/status before and after each series of triggers:
+% the command string is no longer copied (and leaked) on each call, the memory should not grow.
+
+clear all % to be sure to clean all MEX files
+clc
+
+n_triggers = 1e6;
+
+ppMEG('open', 'sim');
+ppMEG('sim', 'latency', 0, 'jitter', 0);
+
+calls = {@(v) ppMEG('write', v), @(v) ppMEG('w', v), @(v) ppMEG(v)};
+names = {'ppMEG(''write'', v)', 'ppMEG(''w'', v)', 'ppMEG(v)'};
+
+for c = 1:numel(calls)
+    call = calls{c};
+    call(0); % warm-up
+    rss_start = resident_memory_kB();
+    t0 = tic;
+    for k = 1:n_triggers
+        call(mod(k, 256));
+    end
+    dt = toc(t0);
+    rss_end = resident_memory_kB();
+    fprintf('%-20s : %.3f us per call, resident memory %+d kB\n', names{c}, 1e6 * dt / n_triggers, rss_end - rss_start);
+end
+
+ppMEG('close');
+
+function rss = resident_memory_kB()
+    status = fileread('/proc/self/status');
+    rss = sscanf(status(strfind(status, 'VmRSS:') + 6:end), '%d', 1);
+end
@@ -0,0 +1,56 @@
+%% Comparing the polling and the interrupt (IRQ) modes of ppMEG('events')
+% For each mode, this script measures:
+%   - the CPU cost: CPU time used by MATLAB (including the event thread of the MEX) while idling
+%   - the detection latency: time between a trigger written on the writing port and the event
+%
+% The latency part requires a loopback cable from a DATA pin of the writing port to the nACK pin
+% (pin 10, STATUS bit 6) of one of the response ports: only nACK raises the parallel port interrupt.
+% The port also needs an IRQ (cat /proc/sys/dev/parport/parport*/irq should not be -1).
+
+clear all % to be sure to clean all MEX files
+clc
+
+modes = {'poll', 'irq'};
+idle_duration = 10;  % s
+n_pulses = 200;
+pulse_width = 2000;  % us
+
+ppMEG('open');
+ppMEG('write', 0);
+
+for m = 1:numel(modes)
+    if strcmp(modes{m}, 'irq')
+        ppMEG('events', 'start', 'irq');
+    else
+        ppMEG('events', 'start');
+    end
+
+    % CPU cost: MATLAB sleeps, the only activity of the process is the event thread
+    cpu_start = cputime;
+    pause(idle_duration);
+    cpu_load = (cputime - cpu_start) / idle_duration;
+
+    % detection latency of the rising edges
+    latency = nan(n_pulses, 1);
+    ppMEG('events'); % flush
+    for k = 1:n_pulses
+        t_high = ppMEG('pulse', 255, pulse_width);
+        pause(0.02);
+        [port, old, new, t] = ppMEG('events');
+        rising = find(bitand(new, 64) ~= bitand(old, 64), 1);
+        if ~isempty(rising)
+            % t_high is taken when PPWDATA returns, the latency can be slightly negative
+            latency(k) = t(rising) - t_high;
+        end
+    end
+    ppMEG('events', 'stop');
+
+    latency = latency(~isnan(latency)) * 1e6;
+    fprintf('%-4s : CPU %5.1f %% | %d/%d edges detected', modes{m}, 100 * cpu_load, numel(latency), n_pulses);
+    if ~isempty(latency)
+        fprintf(' | latency median %.1f us, max %.1f us', median(latency), max(latency));
+    end
+    fprintf('\n');
+end
+
+ppMEG('close');
@@ -0,0 +1,246 @@
+/** Latency distribution of the port accesses of ppMEG, outside MATLAB
+ *
+ * ppMEG.c is compiled in the same program, with the MEX API replaced by the stub of mexstub/:
+ *   gcc -std=gnu11 -O2 -Imexstub benchmarks/ppMEG_bench.c -o ppMEG_bench -lpthread -lm
+ *   ./ppMEG_bench [n_iterations] [ppdev|sim] > results.json
+ *
+ * Measured (min / p50 / p99 / p99.9 / max, in ns, CLOCK_MONOTONIC):
+ *   - open_claim : opening and claiming one port (released between two iterations)
+ *   - write_data : one PPWDATA (or the write of the selected backend)
+ *   - read_status : one PPRSTATUS
+ *   - read_sweep : reading the STATUS of the response ports of the default table (as ppMEG('r'))
+ *   - dispatch_* : a full call of mexFunction, from the parsing of the command to the outputs
+ *   - events_drain_* : ppMEG('events') (double) and ppMEG('events', 'native') on 10^6 events, pushed in the ring
+ *     in batches of BENCH_DRAIN_BATCH events, one sample per drain of a full batch
+ *
+ * The ppdev backend is used when the ports of the default table of ppMEG.c can be opened, the simulated ports
+ * (without latency) otherwise. The results are written on stdout as one JSON object.
+ * */
+#include "../ppMEG.c"
+
+#define BENCH_DEFAULT_ITERATIONS 100000
+#define BENCH_OPEN_ITERATIONS 1000
+#define BENCH_DRAIN_EVENTS 1000000
+#define BENCH_DRAIN_BATCH 62500 // fits in the event ring
+
+typedef struct
+{
+    const char *name;
+    uint64_t *samples; // ns
+    size_t n;
+} BenchResult;
+
+static int compareNs(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p)
+{
+    size_t k = (size_t)(p * (n - 1) + 0.5);
+    return sorted[k < n ? k : n - 1];
+}
+
+static void printResult(BenchResult *result, int last)
+{
+    uint64_t *s = result->samples;
+    size_t n = result->n;
+
+    qsort(s, n, sizeof(uint64_t), compareNs);
+    printf("    \"%s\": {\"n\": %zu, \"min\": %llu, \"p50\": %llu, \"p99\": %llu, \"p99.9\": %llu, \"max\": %llu}%s\n",
+           result->name, n, (unsigned long long)s[0], (unsigned long long)percentile(s, n, 0.5),
+           (unsigned long long)percentile(s, n, 0.99), (unsigned long long)percentile(s, n, 0.999),
+           (unsigned long long)s[n - 1], last ? "" : ",");
+}
+
+#define BENCH_PORTS (int)(sizeof(default_ports) / sizeof(default_ports[0]))
+
+static int ppdevAvailable(void)
+{
+    for (int i = 0; i < BENCH_PORTS; i++)
+        if (access(default_ports[i].address, R_OK | W_OK) != 0)
+            return 0;
+    return 1;
+}
+
+static void fail(const char *what, int err)
+{
+    fprintf(stderr, "%s: %s (%d)\n", what, strerror(err), err);
+    exit(1);
+}
+
+/* one call of mexFunction, the outputs are destroyed as MATLAB would do */
+static uint64_t timeCall(int nlhs, int nrhs, const mxArray *prhs[])
+{
+    mxArray *plhs[8] = {NULL};
+    uint64_t t0 = monotonicNs(), t1;
+
+    if (mexStubCall(nlhs, plhs, nrhs, prhs) != 0)
+    {
+        fprintf(stderr, "mexFunction: %s\n", mex_stub_error);
+        exit(1);
+    }
+    t1 = monotonicNs();
+    for (int k = 0; k < 8; k++)
+        mxDestroyArray(plhs[k]);
+    return t1 - t0;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_DEFAULT_ITERATIONS;
+    const PortBackend *backend = ppdevAvailable() ? &ppdev_backend : &sim_backend;
+    BenchResult results[9];
+    size_t n_results = 0;
+    unsigned char value;
+    int err;
+
+    if (argc > 2)
+        backend = strcmp(argv[2], "sim") == 0 ? &sim_backend : &ppdev_backend;
+    if (n == 0)
+        n = BENCH_DEFAULT_ITERATIONS;
+    mex_stub_quiet = 1;
+
+    /* same table as ppMEG('open') */
+    port_count = BENCH_PORTS;
+    for (int i = 0; i < port_count; i++)
+    {
+        configurePort(i, default_ports[i].address, default_ports[i].role);
+        if (default_ports[i].role & PORT_OUT)
+            writing_port_idx = i;
+    }
+
+    /* open + claim of the writing port, released after each iteration */
+    results[n_results] = (BenchResult){"open_claim", calloc(BENCH_OPEN_ITERATIONS, sizeof(uint64_t)),
+                                      BENCH_OPEN_ITERATIONS};
+    for (size_t k = 0; k < BENCH_OPEN_ITERATIONS; k++)
+    {
+        ParPort *port = &pports[writing_port_idx];
+        uint64_t t0 = monotonicNs();
+
+        if ((err = backend->open(port, port->address)) != 0)
+            fail("open", err);
+        if ((err = backend->claim(port)) != 0)
+            fail("claim", err);
+        results[n_results].samples[k] = monotonicNs() - t0;
+        backend->release(port);
+    }
+    n_results++;
+
+    /* raw accesses on the opened ports */
+    for (int i = 0; i < port_count; i++)
+    {
+        if ((err = backend->open(&pports[i], pports[i].address)) != 0)
+            fail("open", err);
+        if ((err = backend->claim(&pports[i])) != 0)
+            fail("claim", err);
+        pports[i].backend = backend;
+    }
+
+    results[n_results] = (BenchResult){"write_data", calloc(n, sizeof(uint64_t)), n};
+    for (size_t k = 0; k < n; k++)
+    {
+        uint64_t t0 = monotonicNs();
+        backend->write_data(&pports[writing_port_idx], (unsigned char)(k & 1 ? 255 : 0));
+        results[n_results].samples[k] = monotonicNs() - t0;
+    }
+    backend->write_data(&pports[writing_port_idx], 0);
+    n_results++;
+
+    results[n_results] = (BenchResult){"read_status", calloc(n, sizeof(uint64_t)), n};
+    for (size_t k = 0; k < n; k++)
+    {
+        uint64_t t0 = monotonicNs();
+        backend->read_status(&pports[0], &value);
+        results[n_results].samples[k] = monotonicNs() - t0;
+    }
+    n_results++;
+
+    results[n_results] = (BenchResult){"read_sweep", calloc(n, sizeof(uint64_t)), n};
+    for (size_t k = 0; k < n; k++)
+    {
+        uint64_t t0 = monotonicNs();
+        for (int i = 0; i < port_count; i++)
+            if (pports[i].role & PORT_IN)
+                readPort(&value, i);
+        results[n_results].samples[k] = monotonicNs() - t0;
+    }
+    n_results++;
+
+    /* full MEX calls, as from MATLAB */
+    unloadAll();
+    {
+        mxArray *open_args[2] = {mxCreateString("open"), mxCreateString(backend->name)};
+        mxArray *write_args[2] = {mxCreateString("w"), mxCreateDoubleScalar(0)};
+        mxArray *read_args[1] = {mxCreateString("r")};
+        mxArray *events_args[2] = {mxCreateString("events"), mxCreateString("native")};
+        mxArray *close_args[1] = {mxCreateString("c")};
+
+        if (mexStubCall(0, NULL, 2, (const mxArray **)open_args) != 0)
+            fail(mex_stub_error, EIO);
+
+        results[n_results] = (BenchResult){"dispatch_write", calloc(n, sizeof(uint64_t)), n};
+        for (size_t k = 0; k < n; k++)
+        {
+            *mxGetPr(write_args[1]) = k & 1 ? 255 : 0;
+            results[n_results].samples[k] = timeCall(0, 2, (const mxArray **)write_args);
+        }
+        n_results++;
+
+        results[n_results] = (BenchResult){"dispatch_bare_write", calloc(n, sizeof(uint64_t)), n};
+        for (size_t k = 0; k < n; k++)
+        {
+            *mxGetPr(write_args[1]) = k & 1 ? 255 : 0;
+            results[n_results].samples[k] = timeCall(0, 1, (const mxArray **)&write_args[1]);
+        }
+        n_results++;
+
+        results[n_results] = (BenchResult){"dispatch_read", calloc(n, sizeof(uint64_t)), n};
+        for (size_t k = 0; k < n; k++)
+            results[n_results].samples[k] = timeCall(3, 1, (const mxArray **)read_args);
+        n_results++;
+
+        /* the same synthetic events for both outputs, pushed as the event thread would do */
+        for (int native = 0; native < 2; native++)
+        {
+            size_t n_batches = BENCH_DRAIN_EVENTS / BENCH_DRAIN_BATCH;
+
+            results[n_results] = (BenchResult){native ? "events_drain_native" : "events_drain_double",
+                                              calloc(n_batches, sizeof(uint64_t)), n_batches};
+            for (size_t b = 0; b < n_batches; b++)
+            {
+                for (size_t k = 0; k < BENCH_DRAIN_BATCH; k++)
+                {
+                    PortEvent event = {.t_ns = monotonicNs(), .port = k % BENCH_PORTS, .old_status = (unsigned char)k,
+                                       .new_status = (unsigned char)(k + 1)};
+                    pushEvent(&event);
+                }
+                results[n_results].samples[b] = timeCall(4, 1 + native, (const mxArray **)events_args);
+            }
+            n_results++;
+        }
+
+        *mxGetPr(write_args[1]) = 0;
+        timeCall(0, 2, (const mxArray **)write_args);
+        mexStubCall(0, NULL, 1, (const mxArray **)close_args);
+        mxDestroyArray(open_args[0]);
+        mxDestroyArray(open_args[1]);
+        mxDestroyArray(write_args[0]);
+        mxDestroyArray(write_args[1]);
+        mxDestroyArray(read_args[0]);
+        mxDestroyArray(events_args[0]);
+        mxDestroyArray(events_args[1]);
+        mxDestroyArray(close_args[0]);
+    }
+    mexStubClear();
+
+    printf("{\n  \"backend\": \"%s\",\n  \"iterations\": %zu,\n  \"results_ns\": {\n", backend->name, n);
+    for (size_t r = 0; r < n_results; r++)
+    {
+        printResult(&results[r], r + 1 == n_results);
+        free(results[r].samples);
+    }
+    printf("  }\n}\n");
+    return 0;
+}
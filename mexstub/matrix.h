@@ -0,0 +1,447 @@
+/** Minimal replacement of the MATLAB matrix API, to build ppMEG.c outside MATLAB
+ *
+ * Only the functions used by ppMEG.c are implemented (numeric, char, logical, cell and struct arrays).
+ * Header only: ppMEG.c is meant to be included in the same translation unit as the program using it.
+ * */
+#ifndef PPMEG_STUB_MATRIX_H
+#define PPMEG_STUB_MATRIX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+typedef size_t mwSize;
+typedef size_t mwIndex;
+typedef uint16_t mxChar;
+
+typedef enum
+{
+    mxUNKNOWN_CLASS,
+    mxCELL_CLASS,
+    mxSTRUCT_CLASS,
+    mxLOGICAL_CLASS,
+    mxCHAR_CLASS,
+    mxVOID_CLASS,
+    mxDOUBLE_CLASS,
+    mxSINGLE_CLASS,
+    mxINT8_CLASS,
+    mxUINT8_CLASS,
+    mxINT16_CLASS,
+    mxUINT16_CLASS,
+    mxINT32_CLASS,
+    mxUINT32_CLASS,
+    mxINT64_CLASS,
+    mxUINT64_CLASS
+} mxClassID;
+
+typedef enum
+{
+    mxREAL,
+    mxCOMPLEX
+} mxComplexity;
+
+typedef struct mxArray_tag
+{
+    mxClassID class_id;
+    size_t m, n;
+    void *data;        // elements (mxArray * for cells and structs, field by field for each element)
+    int n_fields;
+    char **field_names;
+} mxArray;
+
+static inline size_t mxStubElementSize(mxClassID class_id)
+{
+    switch (class_id)
+    {
+    case mxCELL_CLASS:
+    case mxSTRUCT_CLASS:
+        return sizeof(mxArray *);
+    case mxLOGICAL_CLASS:
+    case mxINT8_CLASS:
+    case mxUINT8_CLASS:
+        return 1;
+    case mxCHAR_CLASS:
+    case mxINT16_CLASS:
+    case mxUINT16_CLASS:
+        return 2;
+    case mxSINGLE_CLASS:
+    case mxINT32_CLASS:
+    case mxUINT32_CLASS:
+        return 4;
+    default:
+        return 8;
+    }
+}
+
+/* memory and arrays allocated during a MEX call (mexStubCall) and not yet freed nor owned by another array: freed
+   by mxStubRelease if the call fails, as MATLAB does when a MEX file raises an error */
+typedef struct
+{
+    void *ptr;
+    bool is_array;
+} mxStubAllocation;
+
+static mxStubAllocation *mx_stub_allocations = NULL;
+static size_t mx_stub_n_allocations = 0, mx_stub_capacity = 0;
+static bool mx_stub_tracking = false;
+
+static inline void mxStubTrack(void *ptr, bool is_array)
+{
+    if (!mx_stub_tracking || ptr == NULL)
+        return;
+    if (mx_stub_n_allocations == mx_stub_capacity)
+    {
+        size_t capacity = mx_stub_capacity > 0 ? 2 * mx_stub_capacity : 64;
+        mxStubAllocation *allocations =
+            (mxStubAllocation *)realloc(mx_stub_allocations, capacity * sizeof(mxStubAllocation));
+
+        if (allocations == NULL)
+            return; // not freed on error, as before
+        mx_stub_allocations = allocations;
+        mx_stub_capacity = capacity;
+    }
+    mx_stub_allocations[mx_stub_n_allocations++] = (mxStubAllocation){ptr, is_array};
+}
+
+/* the most recent allocations are the most likely to be freed first */
+static inline void mxStubUntrack(const void *ptr)
+{
+    if (!mx_stub_tracking || ptr == NULL)
+        return;
+    for (size_t k = mx_stub_n_allocations; k-- > 0;)
+        if (mx_stub_allocations[k].ptr == ptr)
+        {
+            mx_stub_allocations[k] = mx_stub_allocations[--mx_stub_n_allocations];
+            return;
+        }
+}
+
+static inline void *mxMalloc(size_t n)
+{
+    void *ptr = malloc(n > 0 ? n : 1);
+    mxStubTrack(ptr, false);
+    return ptr;
+}
+
+static inline void *mxCalloc(size_t n, size_t size)
+{
+    void *ptr = calloc(n > 0 ? n : 1, size > 0 ? size : 1);
+    mxStubTrack(ptr, false);
+    return ptr;
+}
+
+static inline void *mxRealloc(void *ptr, size_t n)
+{
+    void *moved;
+
+    mxStubUntrack(ptr);
+    moved = realloc(ptr, n > 0 ? n : 1);
+    mxStubTrack(moved != NULL ? moved : ptr, false);
+    return moved;
+}
+
+static inline void mxFree(void *ptr)
+{
+    mxStubUntrack(ptr);
+    free(ptr);
+}
+
+static inline mxArray *mxStubCreate(mxClassID class_id, size_t m, size_t n, int n_fields)
+{
+    mxArray *array = (mxArray *)calloc(1, sizeof(mxArray));
+    size_t slots = m * n * (class_id == mxSTRUCT_CLASS ? (size_t)n_fields : 1);
+
+    array->class_id = class_id;
+    array->m = m;
+    array->n = n;
+    array->n_fields = n_fields;
+    array->data = calloc(slots > 0 ? slots : 1, mxStubElementSize(class_id));
+    mxStubTrack(array, true);
+    return array;
+}
+
+/* the elements of a cell or a struct belong to it, they are not tracked */
+static inline void mxStubDestroy(mxArray *array)
+{
+    size_t slots;
+
+    if (array == NULL)
+        return;
+    if (array->class_id == mxCELL_CLASS || array->class_id == mxSTRUCT_CLASS)
+    {
+        slots = array->m * array->n * (array->class_id == mxSTRUCT_CLASS ? (size_t)array->n_fields : 1);
+        for (size_t k = 0; k < slots; k++)
+            mxStubDestroy(((mxArray **)array->data)[k]);
+    }
+    for (int k = 0; k < array->n_fields; k++)
+        free(array->field_names[k]);
+    free(array->field_names);
+    free(array->data);
+    free(array);
+}
+
+static inline void mxDestroyArray(mxArray *array)
+{
+    mxStubUntrack(array);
+    mxStubDestroy(array);
+}
+
+/* end of a MEX call: the remaining allocations are freed if it failed, kept (returned, or leaked) otherwise */
+static inline void mxStubRelease(bool failed)
+{
+    for (size_t k = 0; failed && k < mx_stub_n_allocations; k++)
+    {
+        if (mx_stub_allocations[k].is_array)
+            mxStubDestroy((mxArray *)mx_stub_allocations[k].ptr);
+        else
+            free(mx_stub_allocations[k].ptr);
+    }
+    mx_stub_n_allocations = 0;
+    mx_stub_tracking = false;
+}
+
+static inline mxArray *mxCreateNumericMatrix(mwSize m, mwSize n, mxClassID class_id, mxComplexity flag)
+{
+    (void)flag;
+    return mxStubCreate(class_id, m, n, 0);
+}
+
+static inline mxArray *mxCreateNumericArray(mwSize ndim, const mwSize *dims, mxClassID class_id, mxComplexity flag)
+{
+    size_t n = 1;
+
+    for (mwSize k = 1; k < ndim; k++)
+        n *= dims[k];
+    return mxCreateNumericMatrix(ndim > 0 ? dims[0] : 0, n, class_id, flag);
+}
+
+static inline mxArray *mxCreateDoubleMatrix(mwSize m, mwSize n, mxComplexity flag)
+{
+    return mxCreateNumericMatrix(m, n, mxDOUBLE_CLASS, flag);
+}
+
+static inline mxArray *mxCreateDoubleScalar(double value)
+{
+    mxArray *array = mxCreateDoubleMatrix(1, 1, mxREAL);
+    *(double *)array->data = value;
+    return array;
+}
+
+static inline mxArray *mxCreateLogicalMatrix(mwSize m, mwSize n)
+{
+    return mxStubCreate(mxLOGICAL_CLASS, m, n, 0);
+}
+
+static inline mxArray *mxCreateLogicalScalar(bool value)
+{
+    mxArray *array = mxCreateLogicalMatrix(1, 1);
+    *(bool *)array->data = value;
+    return array;
+}
+
+static inline mxArray *mxCreateString(const char *str)
+{
+    size_t n = strlen(str);
+    mxArray *array = mxStubCreate(mxCHAR_CLASS, n > 0 ? 1 : 0, n, 0);
+
+    for (size_t k = 0; k < n; k++)
+        ((mxChar *)array->data)[k] = (unsigned char)str[k];
+    return array;
+}
+
+static inline mxArray *mxCreateCharArray(mwSize ndim, const mwSize *dims)
+{
+    size_t n = 1;
+
+    for (mwSize k = 1; k < ndim; k++)
+        n *= dims[k];
+    return mxStubCreate(mxCHAR_CLASS, ndim > 0 ? dims[0] : 0, n, 0);
+}
+
+static inline mxArray *mxCreateLogicalArray(mwSize ndim, const mwSize *dims)
+{
+    size_t n = 1;
+
+    for (mwSize k = 1; k < ndim; k++)
+        n *= dims[k];
+    return mxStubCreate(mxLOGICAL_CLASS, ndim > 0 ? dims[0] : 0, n, 0);
+}
+
+static inline mxArray *mxCreateCellMatrix(mwSize m, mwSize n)
+{
+    return mxStubCreate(mxCELL_CLASS, m, n, 0);
+}
+
+static inline mxArray *mxCreateCellArray(mwSize ndim, const mwSize *dims)
+{
+    size_t n = 1;
+
+    for (mwSize k = 1; k < ndim; k++)
+        n *= dims[k];
+    return mxCreateCellMatrix(ndim > 0 ? dims[0] : 0, n);
+}
+
+static inline mxArray *mxCreateStructMatrix(mwSize m, mwSize n, int n_fields, const char **field_names)
+{
+    mxArray *array = mxStubCreate(mxSTRUCT_CLASS, m, n, n_fields);
+
+    array->field_names = (char **)calloc(n_fields > 0 ? n_fields : 1, sizeof(char *));
+    for (int k = 0; k < n_fields; k++)
+        array->field_names[k] = strdup(field_names[k]);
+    return array;
+}
+
+static inline mxArray *mxCreateStructArray(mwSize ndim, const mwSize *dims, int n_fields, const char **field_names)
+{
+    size_t n = 1;
+
+    for (mwSize k = 1; k < ndim; k++)
+        n *= dims[k];
+    return mxCreateStructMatrix(ndim > 0 ? dims[0] : 0, n, n_fields, field_names);
+}
+
+static inline mxClassID mxGetClassID(const mxArray *array) { return array->class_id; }
+static inline size_t mxGetM(const mxArray *array) { return array->m; }
+static inline size_t mxGetN(const mxArray *array) { return array->n; }
+static inline void mxSetM(mxArray *array, mwSize m) { array->m = m; }
+static inline void mxSetN(mxArray *array, mwSize n) { array->n = n; }
+static inline mwSize mxGetNumberOfDimensions(const mxArray *array) { (void)array; return 2; }
+/* m and n are consecutive: they are the dimensions */
+_Static_assert(offsetof(mxArray, n) == offsetof(mxArray, m) + sizeof(size_t), "m, n must be consecutive");
+static inline const mwSize *mxGetDimensions(const mxArray *array) { return &array->m; }
+static inline size_t mxGetNumberOfElements(const mxArray *array) { return array->m * array->n; }
+static inline size_t mxGetElementSize(const mxArray *array) { return mxStubElementSize(array->class_id); }
+static inline bool mxIsEmpty(const mxArray *array) { return array->m * array->n == 0; }
+static inline bool mxIsChar(const mxArray *array) { return array->class_id == mxCHAR_CLASS; }
+static inline bool mxIsCell(const mxArray *array) { return array->class_id == mxCELL_CLASS; }
+static inline bool mxIsStruct(const mxArray *array) { return array->class_id == mxSTRUCT_CLASS; }
+static inline bool mxIsLogical(const mxArray *array) { return array->class_id == mxLOGICAL_CLASS; }
+static inline bool mxIsDouble(const mxArray *array) { return array->class_id == mxDOUBLE_CLASS; }
+static inline bool mxIsComplex(const mxArray *array) { (void)array; return false; }
+static inline bool mxIsSparse(const mxArray *array) { (void)array; return false; }
+static inline bool mxIsNumeric(const mxArray *array) { return array->class_id >= mxDOUBLE_CLASS; }
+static inline bool mxIsUint8(const mxArray *array) { return array->class_id == mxUINT8_CLASS; }
+
+static inline void *mxGetData(const mxArray *array) { return array->data; }
+static inline double *mxGetPr(const mxArray *array) { return (double *)array->data; }
+static inline mxChar *mxGetChars(const mxArray *array) { return (mxChar *)array->data; }
+
+static inline void mxSetData(mxArray *array, void *data)
+{
+    mxStubUntrack(data);
+    free(array->data);
+    array->data = data;
+}
+
+static inline double mxGetScalar(const mxArray *array)
+{
+    if (array->m * array->n == 0)
+        return 0;
+    switch (array->class_id)
+    {
+    case mxDOUBLE_CLASS:
+        return ((double *)array->data)[0];
+    case mxSINGLE_CLASS:
+        return ((float *)array->data)[0];
+    case mxLOGICAL_CLASS:
+    case mxUINT8_CLASS:
+        return ((uint8_t *)array->data)[0];
+    case mxINT8_CLASS:
+        return ((int8_t *)array->data)[0];
+    case mxCHAR_CLASS:
+    case mxUINT16_CLASS:
+        return ((uint16_t *)array->data)[0];
+    case mxINT16_CLASS:
+        return ((int16_t *)array->data)[0];
+    case mxUINT32_CLASS:
+        return ((uint32_t *)array->data)[0];
+    case mxINT32_CLASS:
+        return ((int32_t *)array->data)[0];
+    case mxUINT64_CLASS:
+        return (double)((uint64_t *)array->data)[0];
+    case mxINT64_CLASS:
+        return (double)((int64_t *)array->data)[0];
+    default:
+        return 0;
+    }
+}
+
+static inline bool mxIsLogicalScalarTrue(const mxArray *array)
+{
+    return array->class_id == mxLOGICAL_CLASS && array->m * array->n == 1 && *(bool *)array->data;
+}
+
+/* returns 1 (and a truncated string) if the buffer is too small, as the MATLAB version */
+static inline int mxGetString(const mxArray *array, char *buf, mwSize buflen)
+{
+    size_t n = array->class_id == mxCHAR_CLASS ? array->m * array->n : 0;
+    size_t k;
+
+    if (buflen == 0)
+        return 1;
+    for (k = 0; k < n && k + 1 < buflen; k++)
+        buf[k] = (char)((mxChar *)array->data)[k];
+    buf[k] = '\0';
+    return array->class_id != mxCHAR_CLASS || k < n;
+}
+
+static inline char *mxArrayToString(const mxArray *array)
+{
+    size_t n = array->m * array->n;
+    char *str = (char *)mxMalloc(n + 1);
+
+    mxGetString(array, str, n + 1);
+    return str;
+}
+
+static inline mxArray *mxGetCell(const mxArray *array, mwIndex k) { return ((mxArray **)array->data)[k]; }
+
+static inline void mxSetCell(mxArray *array, mwIndex k, mxArray *value)
+{
+    mxStubUntrack(value);
+    ((mxArray **)array->data)[k] = value;
+}
+
+static inline int mxGetNumberOfFields(const mxArray *array) { return array->n_fields; }
+
+static inline const char *mxGetFieldNameByNumber(const mxArray *array, int k) { return array->field_names[k]; }
+
+static inline int mxGetFieldNumber(const mxArray *array, const char *name)
+{
+    for (int k = 0; k < array->n_fields; k++)
+        if (strcmp(array->field_names[k], name) == 0)
+            return k;
+    return -1;
+}
+
+static inline mxArray *mxGetFieldByNumber(const mxArray *array, mwIndex k, int field)
+{
+    return ((mxArray **)array->data)[k * array->n_fields + field];
+}
+
+static inline void mxSetFieldByNumber(mxArray *array, mwIndex k, int field, mxArray *value)
+{
+    mxStubUntrack(value);
+    ((mxArray **)array->data)[k * array->n_fields + field] = value;
+}
+
+static inline mxArray *mxGetField(const mxArray *array, mwIndex k, const char *name)
+{
+    int field = mxGetFieldNumber(array, name);
+    return field < 0 ? NULL : mxGetFieldByNumber(array, k, field);
+}
+
+static inline void mxSetField(mxArray *array, mwIndex k, const char *name, mxArray *value)
+{
+    int field = mxGetFieldNumber(array, name);
+    if (field >= 0)
+        mxSetFieldByNumber(array, k, field, value);
+}
+
+static inline double mxGetNaN(void) { return NAN; }
+static inline double mxGetInf(void) { return INFINITY; }
+
+#endif
@@ -0,0 +1,119 @@
+/** Minimal replacement of the MEX API, to build ppMEG.c outside MATLAB
+ *
+ * mexErrMsgTxt jumps back to the last mexStubCall (as MATLAB does at the end of the MEX call) and
+ * mexPrintf writes to stdout, unless mex_stub_quiet is set, or to mex_stub_output if set (the daemon sends the
+ * text to its client).
+ * */
+#ifndef PPMEG_STUB_MEX_H
+#define PPMEG_STUB_MEX_H
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include "matrix.h"
+
+static jmp_buf mex_stub_error_jump;
+static int mex_stub_in_call = 0;
+static char mex_stub_error[256];
+static int mex_stub_quiet = 0;
+static void (*mex_stub_at_exit)(void) = NULL;
+static void (*mex_stub_output)(const char *text, size_t n) = NULL;
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]);
+
+static inline int mexPrintf(const char *format, ...)
+{
+    va_list args;
+    int n = 0;
+
+    if (mex_stub_output != NULL)
+    {
+        char text[1024];
+
+        va_start(args, format);
+        n = vsnprintf(text, sizeof(text), format, args);
+        va_end(args);
+        if (n > 0)
+            mex_stub_output(text, (size_t)n < sizeof(text) ? (size_t)n : sizeof(text) - 1);
+    }
+    else if (!mex_stub_quiet)
+    {
+        va_start(args, format);
+        n = vprintf(format, args);
+        va_end(args);
+    }
+    return n;
+}
+
+static inline void mexErrMsgTxt(const char *msg)
+{
+    snprintf(mex_stub_error, sizeof(mex_stub_error), "%s", msg);
+    if (mex_stub_in_call)
+        longjmp(mex_stub_error_jump, 1);
+    fprintf(stderr, "mexErrMsgTxt outside of a MEX call: %s\n", msg);
+    abort();
+}
+
+static inline void mexErrMsgIdAndTxt(const char *id, const char *format, ...)
+{
+    char msg[256];
+    va_list args;
+
+    (void)id;
+    va_start(args, format);
+    vsnprintf(msg, sizeof(msg), format, args);
+    va_end(args);
+    mexErrMsgTxt(msg);
+}
+
+static inline void mexWarnMsgTxt(const char *msg)
+{
+    if (!mex_stub_quiet)
+        fprintf(stderr, "Warning: %s\n", msg);
+}
+
+static inline int mexAtExit(void (*function)(void))
+{
+    mex_stub_at_exit = function;
+    return 0;
+}
+
+static inline void mexMakeMemoryPersistent(void *ptr) { (void)ptr; }
+static inline void mexMakeArrayPersistent(mxArray *array) { (void)array; }
+static inline void mexLock(void) {}
+static inline void mexUnlock(void) {}
+
+/**
+ * Call mexFunction as MATLAB would
+ *
+ * Returns 0, or -1 if mexFunction raised an error (the message is then in mex_stub_error). On error, the memory
+ * and the arrays allocated during the call are freed, the outputs included (plhs is then NULL).
+ * */
+static inline int mexStubCall(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    mex_stub_in_call = 1;
+    mex_stub_error[0] = '\0';
+    mx_stub_tracking = true;
+    if (setjmp(mex_stub_error_jump) != 0)
+    {
+        mex_stub_in_call = 0;
+        mxStubRelease(true);
+        for (int k = 0; plhs != NULL && k < (nlhs > 0 ? nlhs : 1); k++)
+            plhs[k] = NULL;
+        return -1;
+    }
+    mexFunction(nlhs, plhs, nrhs, prhs);
+    mex_stub_in_call = 0;
+    mxStubRelease(false);
+    return 0;
+}
+
+/* what MATLAB does on 'clear mex' */
+static inline void mexStubClear(void)
+{
+    if (mex_stub_at_exit != NULL)
+        mex_stub_at_exit();
+    mex_stub_at_exit = NULL;
+}
+
+#endif
@@ -19,241 +19,3786 @@
  * 
  * a) Using one port
  * >> ppMEG('open', '/dev/parport1')    % open and claim access to one port for writing/reading
+ * >> ppMEG('open', '/dev/parport1', 'ioport')  % same, but DATA/STATUS are then accessed with outb/inb (root only)
  * >> value = ppMEG('read')             % read current value on the STATUS pins of '/dev/parport1'
  * >> ppMEG('write', 200)               % write 200 on the DATA pins of '/dev/parport1')
  * >> ppMEG('close')                    % release and close the port
  * 
  * b) Using multiple ports (all commands can be abbreviated with the first letter)
- * >> ppMEG('o')                                % open all ports
+ * >> ppMEG('o')                                % open all ports ('open', 'ioport' for the direct I/O access)
  * >> [val_pp1 val_pp2 val_pp3] = ppMEG('r')    % read all the ports previously opened
  * >> ppMEG('w', 200)                           % write on the writing port (default = '/dev/paport1')
+ * >> ppMEG(200)                                % same, fastest call
  * >> ppMEG('c')                                % close all ports
+ * >> ppMEG('o', {'/dev/parport0', '/dev/parport1', '/dev/parport2', '/dev/parport3'}, 'ioii')
+ * >>                                           % any table: 'i' response port, 'o' trigger port, 'b' both
+ * >> ppMEG('o', 'discover', 'oiii')            % every /dev/parport* found, in order
+ * >> ppMEG('decode', [1 3], [3 4 5 6 7])       % 'r', events, ... return the buttons on bits 0-4 (BUSY inverted)
+ * >> ppMEG('set', 128)                         % bit 7 to 1, the other DATA bits are unchanged
+ * >> ppMEG('clear', 128)                       % bit 7 to 0 ('toggle' inverts the bits of the mask)
+ * >> ppMEG('queue', 5000)                      % from now, 'w' returns at once and each value is held >= 5 ms
+ *
+ * c) Self-resetting trigger (the reset to 0 is done by a timer thread of the MEX)
+ * >> t_high = ppMEG('pulse', 200, 8000)         % write 200, back to 0 after 8000 us, returns immediately
+ * >> [t_high, t_low] = ppMEG('pulse')           % timestamps (CLOCK_MONOTONIC, in s) of the last pulse
+ * >> ppMEG('pulse', 128, 500000, 128)           % bit 7 for 500 ms ...
+ * >> ppMEG('pulse', 5, 2000, 15)                % ... with 2 ms codes on bits 0-3 in the meantime
+ *
+ * d) Response events recorded by a background thread polling the STATUS pins
+ * >> ppMEG('events', 'start')                   % start polling all the opened ports
+ * >> ppMEG('events', 'start', 'irq')            % or sleep until a nACK interrupt instead of polling
+ * >> [port, old, new, t] = ppMEG('events')      % every change since the last call (t in s, CLOCK_MONOTONIC)
+ * >> [port, old, new, t_ns] = ppMEG('events', 'native')  % same as uint8 / uint64 ns columns, without conversion
+ * >> ppMEG('events', 'stop')
+ *
+ * e) Simulated ports (no hardware required), e.g. to measure the timing of the MEX
+ * >> ppMEG('open', 'sim')                       % 3 simulated ports, or ppMEG('open', 'name', 'sim')
+ * >> ppMEG('sim', 'latency', 2, 'jitter', 1)    % each access takes 2 us + [0, 1] us
+ * >> ppMEG('sim', 'status', 1, [0 8], [0 0.5])  % STATUS of port 1 : 0, then 8 after 0.5 s
+ *
+ * f) Trigger sequence played by a thread at given times (CLOCK_MONOTONIC, in s)
+ * >> t0 = ppMEG('now') + 1;
+ * >> ppMEG('schedule', t0 + (0:9) * 0.1, [1:10])  % returns immediately
+ * >> [lateness, n_played] = ppMEG('schedule')      % lateness of each write (NaN if not played yet)
+ * >> ppMEG('train', 128, 25000, 5000)              % 40 Hz pulses of 5 ms on bit 7 until ppMEG('train', 'stop')
+ * >> info = ppMEG('train')                         % pulses sent, achieved period (mean, std, min, max in us)
+ *
+ * g) Audit of the writes (every write is timestamped before/after the access to the port)
+ * >> [seq, value, t_before, t_after, port] = ppMEG('log')       % or ppMEG('log', 'native'): uint32 / uint8 / uint64 ns
+ * >> ppMEG('log', 'reset')
+ * >> ppMEG('record', 'session.ppr')             % every change of the pins in a file, until ppMEG('record', 'stop')
+ * >> ppMEG('share', '/ppMEG')                   % triggers and events in shared memory for other processes (ppMEG_shm.h)
+ *
+ * h) Real-time settings of the threads of the MEX (SCHED_FIFO requires the rtprio limit or root)
+ * >> report = ppMEG('rtconfig', 'priority', 80, 'cpu', 3, 'lock', true)
+ *
+ * i) Precision wait (sleep, then spin on the clock for the last part)
+ * >> overshoot = ppMEG('waituntil', ppMEG('now') + 0.008)
+ *
+ * j) Reaction time measured in C from the last trigger
+ * >> ppMEG('w', 10);
+ * >> [port, value, rt] = ppMEG('waitresponse', 64, 2)   % wait (max 2 s) until STATUS bit 6 changes on a port
+ * >> [status, t_ns] = ppMEG('capture', [1 3], 1e6)       % 10^6 samples of ports 1 and 3, as fast as possible
+ * >> ppMEG('rule', 1, 3, 100)                           % events thread: bit 3 of port 1 goes high -> write 100
+ * >> ppMEG('rule', 'arm')                               % once per arming, at each trial
+ *
+ * k) Latency statistics kept by the MEX (durations of the accesses, lateness of the sequences, ...)
+ * >> stats = ppMEG('stats')                     % struct array: name, port, count, min, p50, p90, p99, p999, max, mean
+ * >> ppMEG('stats', 'reset')
+ *
+ * l) Ports owned by the daemon ppMEGd (built from this file), the calls are sent over a Unix domain socket
+ * >> ppMEG('connect')                           % or ppMEG('connect', socket), then every call runs in the daemon
+ * >> ppMEG('disconnect')                        % the ports of the daemon stay open
  * */
+#ifndef _GNU_SOURCE /* unless given with -D_GNU_SOURCE */
+#define _GNU_SOURCE /* For pthread_setaffinity_np and pthread_getattr_np */
+#endif
 #include <sys/io.h>
 #include <unistd.h> /* For open() */
 #include <fcntl.h>  /* For O_RDWR */
 #include <errno.h>
 #include <string.h>
+#include <limits.h> /* For PATH_MAX */
 #include <linux/ppdev.h>
 #include <linux/parport.h>
 #include <sys/ioctl.h> /* For PPWDATA and PPRSTATUS */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "mex.h"
 #include "matrix.h"
+#include "ppMEG_shm.h"
+#include "ppMEG_wire.h"
+
+// latency histograms (HDR-like): 2^HIST_SUB_BITS linear buckets per power of 2 of the value in ns (~6 % precision)
+// from 0 to 2^64 ns. Recording a value is a few relaxed atomic operations, nothing is allocated
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+typedef struct
+{
+    atomic_uint_fast64_t buckets[HIST_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum_ns;
+    atomic_uint_fast64_t max_ns;
+    atomic_uint_fast64_t min_inv_ns; // ~min, so that 0 (reset) means empty and the update is an atomic max too
+} Histogram;
+
+// a port is accessed through a backend: ppdev (ioctl on /dev/parport*), ioport (outb/inb after ioperm) or sim
+// (in-process simulated port). open/claim/release are only called from the Matlab thread and can print details,
+// write_data/read_status are also used by the background threads. All of them return 0 or an errno.
+typedef struct ParPort ParPort;
+typedef struct
+{
+    const char *name;
+    int (*open)(ParPort *port, const char *address);
+    int (*claim)(ParPort *port);
+    int (*write_data)(ParPort *port, unsigned char value);
+    int (*read_data)(ParPort *port, unsigned char *value);
+    int (*read_status)(ParPort *port, unsigned char *value);
+    int (*release)(ParPort *port);
+} PortBackend;
+
+// role of a port in the table: response ports are read ('read', events, ...), the trigger port is written
+#define PORT_IN 1
+#define PORT_OUT 2
+
+struct ParPort
+{
+    const PortBackend *backend; // NULL if the port is not opened
+    char address[PATH_MAX];
+    int role;                   // PORT_IN and/or PORT_OUT
+    atomic_uchar data;          // shadow of the DATA register: last value written (read back at opening)
+    unsigned char decode[256];  // raw STATUS -> value returned by 'read', events and 'waitresponse'
+    Histogram write_hist;       // duration of the writes / reads
+    Histogram read_hist;
+    int fd;                     // ppdev descriptor (ppdev and ioport backends)
+    unsigned short base;        // base I/O address (ioport backend)
+    // simulated port: DATA pins, then STATUS pins given by a script or copied from the DATA of another port
+    atomic_uchar sim_data;
+    unsigned char sim_status;
+    int sim_loopback; // index of the port whose DATA is seen on the STATUS pins, -1 if none
+    uint64_t *sim_script_t; // STATUS = sim_script_status[k] from sim_script_t[k] (CLOCK_MONOTONIC) on
+    unsigned char *sim_script_status;
+    size_t sim_script_n;
+};
 
 // global variables to keep track of the ports
-// by default, the code reads all parallel ports but write on only one (writing_port_idx)
-static int pports[] = {0, 0, 0};
-static char addresses[3][15] = {"/dev/parport0", "/dev/parport1", "/dev/parport4"};
-static int use_multiple_ports = 1;
-static int writing_port_idx = 1;
+// the table is set by 'open' (up to PARPORT_MAX ports, the kernel limit): the response ports are read, the
+// triggers are written on the only output port (writing_port_idx, -1 if none)
+typedef struct
+{
+    const char *address;
+    int role;
+} PortConfig;
+
+static const PortConfig default_ports[] = {
+    {"/dev/parport0", PORT_IN}, {"/dev/parport1", PORT_IN | PORT_OUT}, {"/dev/parport4", PORT_IN}};
+static ParPort pports[PARPORT_MAX];
+static int port_count = 0;
+static int writing_port_idx = -1;
+
+// every change of the DATA pins (full value or bits) is a read-modify-write of the shadow of the port followed
+// by the write, done under data_mutex so that the bits changed by another thread are never lost
+static pthread_mutex_t data_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// settings of the simulated ports, the scripts are protected by sim_mutex
+static uint64_t sim_latency_ns = 0;
+static uint64_t sim_jitter_ns = 0;
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// state of the pulse timer thread: pulse_mutex / pulse_cond wake the thread up. The deadlines and the timestamps
+// of the pulses change with the writes of the port, they are protected by data_mutex: a write cancels the pending
+// resets of the bits it overwrites (see modifyData), so that a reset never overwrites a newer trigger
+static pthread_t pulse_thread;
+static pthread_mutex_t pulse_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pulse_cond;
+static int pulse_thread_running = 0;
+static int pulse_quit = 0;
+static atomic_int pulse_rearm = 0; // set by a new pulse: the thread spinning on an older deadline starts over
+// each DATA bit has its own reset deadline, so that pulses on different bits overlap: finding the next deadline
+// costs at most 8 comparisons, whatever the number of pending pulses
+#define PULSE_COALESCE_NS 1000               // resets due within this time are done in the same write
+static int pulse_port_idx = 0;               // port on which the pending pulses were written
+static uint64_t pulse_deadlines[8] = {0};    // absolute CLOCK_MONOTONIC time of the reset of each bit, 0 if none
+static unsigned char pulse_mask = 0;         // bits of the last pulse
+static uint64_t pulse_high_ns = 0;           // achieved timestamps of the last pulse
+static uint64_t pulse_low_ns = 0;
+
+// every write is recorded in a fixed-size log (the last WRITE_LOG_SIZE writes are kept). The writes can come from
+// several threads: each one takes a sequence number, fills the record and publishes it with done_seq. The log is
+// stored column by column, as the event ring, so that 'log native' copies each column in one piece
+#define WRITE_LOG_SIZE 65536 // must be a power of 2
+typedef struct
+{
+    uint64_t t_before_ns[WRITE_LOG_SIZE]; // CLOCK_MONOTONIC time just before / just after the access to the port
+    uint64_t t_after_ns[WRITE_LOG_SIZE];
+    atomic_uint_fast64_t done_seq[WRITE_LOG_SIZE]; // sequence number + 1 once the record is complete
+    unsigned char port[WRITE_LOG_SIZE];            // from 1, as returned to Matlab
+    unsigned char value[WRITE_LOG_SIZE];
+} WriteLog;
+
+static WriteLog write_log;
+static atomic_uint_fast64_t write_log_seq = 0;   // number of writes since the MEX was loaded
+static atomic_uint_fast64_t write_log_start = 0; // first sequence number returned by 'log' (after a reset)
+static atomic_uint_fast64_t last_trigger_ns = 0;  // end of the last trigger, see writePort (reaction times)
+
+static Histogram hist_schedule;         // lateness of the writes of the schedule thread
+static Histogram hist_event_interval;   // interval between two polls (or two interrupts) of the event thread
+static Histogram hist_record_interval;  // interval between two polls of the record thread
+static Histogram hist_queue_delay;      // time between a 'w' and its write by the queue thread
+static Histogram hist_rule_latency;     // time between the read that saw an edge and the end of the write of a rule
+static Histogram hist_train_lateness;   // lateness of the rising edges of the pulse train
+
+typedef struct
+{
+    const char *name;
+    int port; // 1-based, 0 if not related to a port
+    Histogram *histogram;
+} StatsEntry;
+
+// histograms not related to a port (the durations of the accesses are kept in each ParPort)
+static const StatsEntry stats_entries[] = {{"schedule_lateness", 0, &hist_schedule},
+                                           {"event_interval", 0, &hist_event_interval},
+                                           {"record_interval", 0, &hist_record_interval},
+                                           {"queue_delay", 0, &hist_queue_delay},
+                                           {"rule_latency", 0, &hist_rule_latency},
+                                           {"train_lateness", 0, &hist_train_lateness}};
+
+// STATUS changes seen by the event thread: single-producer (event thread) / single-consumer (Matlab)
+// ring buffer, preallocated so that nothing is allocated while polling. The ring is stored column by column,
+// so that 'events' copies each column to Matlab in (at most) two memcpy
+#define EVENT_RING_SIZE 65536 // must be a power of 2
+typedef struct
+{
+    uint64_t t_ns; // CLOCK_MONOTONIC time of the read that saw the change
+    unsigned char port;
+    unsigned char old_status;
+    unsigned char new_status;
+} PortEvent;
+
+static uint64_t event_t_ns[EVENT_RING_SIZE];
+static unsigned char event_port[EVENT_RING_SIZE]; // from 1, as returned to Matlab
+static unsigned char event_old[EVENT_RING_SIZE];
+static unsigned char event_new[EVENT_RING_SIZE];
+static atomic_uint_fast64_t event_head = 0; // written by the producer only
+static atomic_uint_fast64_t event_tail = 0; // written by the consumer only
+static atomic_uint_fast64_t event_dropped = 0;
+
+static pthread_t event_thread;
+static int event_thread_running = 0;
+static atomic_int event_quit = 0;
+static uint64_t event_period_ns = 0; // 0 = poll continuously
+static int event_use_irq = 0;        // wait for the nACK interrupts instead of polling
+static int event_wake_pipe[2] = {-1, -1};
+static unsigned char event_start_status[PARPORT_MAX]; // read by 'start' before the thread, the first 'last' values
+
+// trigger sequence played by the schedule thread, the arrays are only modified when the thread is stopped
+static pthread_t schedule_thread;
+static int schedule_thread_running = 0;
+static atomic_int schedule_quit = 0;
+static uint64_t *schedule_t_ns = NULL;
+static unsigned char *schedule_values = NULL;
+static int64_t *schedule_lateness_ns = NULL;
+static size_t schedule_n = 0;
+static atomic_size_t schedule_played = 0;
+
+// pulse train played by the train thread: rising edges at train_start_ns + k * train_period_ns (absolute
+// deadlines, the errors do not accumulate). While it runs, the bits of train_reserved belong to the train thread,
+// the other writers leave them unchanged (see modifyData). The achieved periods are summed under train_mutex.
+#define TRAIN_LEAD_NS 1000000 // from the call to the first rising edge, longer than the start of the thread
+static pthread_t train_thread;
+static int train_thread_running = 0;
+static atomic_int train_quit = 0;
+static atomic_uchar train_reserved = 0; // mask of the train while it runs, 0 otherwise
+static int train_port_idx = -1;
+static unsigned char train_mask = 0;
+static uint64_t train_start_ns = 0;
+static uint64_t train_period_ns = 0;
+static uint64_t train_width_ns = 0;
+static uint64_t train_count = 0; // 0 = until stopped
+static pthread_mutex_t train_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t train_pulses = 0;
+static uint64_t train_skipped = 0; // deadlines missed by more than the low part of the period
+static uint64_t train_periods = 0; // achieved periods measured (none across a skipped edge)
+static uint64_t train_last_rise_ns = 0; // 0 after a skipped edge
+static uint64_t train_period_min_ns = 0;
+static uint64_t train_period_max_ns = 0;
+static double train_error_sum = 0;  // of the achieved periods minus train_period_ns (ns, no cancellation)
+static double train_error_sum2 = 0; // of their squares
+
+// closed-loop rules: an edge of a STATUS bit of a response port writes a code on the trigger port, from the
+// event thread right after the read that saw it. rule_mutex is held by the event thread while it goes through
+// the rules (only on a change, if there are rules) and by Matlab to add or clear rules; arming is atomic.
+#define RULE_MAX 32
+typedef struct
+{
+    int port;               // index in pports[]
+    unsigned char mask;     // bit of the decoded STATUS value
+    unsigned char code;
+    int falling;            // 1: the bit goes to 0, 0: the bit goes to 1
+    int repeat;             // 0: disarmed when fired (once per arming)
+    uint64_t width_ns;      // > 0: the code is a pulse
+    atomic_int armed;
+    atomic_uint_fast64_t fired;
+    atomic_uint_fast64_t latency_ns; // of the last firing
+} Rule;
+
+static Rule rules[RULE_MAX];
+static atomic_int rule_count = 0;
+static pthread_mutex_t rule_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// write queue: when it runs, 'w' only pushes the value in a single-producer (Matlab) / single-consumer (queue
+// thread) ring, the thread writes each value and keeps it on the port for at least queue_hold_ns
+#define WRITE_QUEUE_SIZE 4096 // must be a power of 2
+typedef struct
+{
+    uint64_t t_ns; // CLOCK_MONOTONIC time of the 'w' call
+    unsigned char value;
+} QueuedWrite;
+
+static QueuedWrite write_queue[WRITE_QUEUE_SIZE];
+static atomic_uint_fast64_t queue_head = 0; // written by Matlab only
+static atomic_uint_fast64_t queue_tail = 0; // written by the queue thread only
+static pthread_t queue_thread;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER; // only to sleep when the queue is empty
+static pthread_cond_t queue_cond;
+static int queue_thread_running = 0;
+static int queue_quit = 0;               // stop once the queue is empty
+static atomic_int queue_abort = 0;       // stop now, the pending values are lost
+static atomic_uint_fast64_t queue_hold_ns = 0;
+static uint64_t queue_max_depth = 0;     // since the start of the queue
+static uint64_t queue_full = 0;          // values refused because the queue was full
+
+// recording of every change of the STATUS (response ports) and DATA (trigger port, from its shadow) pins in a
+// memory-mapped file, by the record thread. The file is a header page followed by fixed-size records, appended
+// RECORD_CHUNK_RECORDS at a time (the file is grown and the chunk mapped, the previous chunk is unmapped).
+// The number of records of the header is updated after each record: the pages belong to the page cache, so the
+// file stays readable if Matlab crashes (read it with ppMEG_readrecord.m)
+#define RECORD_MAGIC "PPMEGREC"
+#define RECORD_VERSION 1
+#define RECORD_HEADER_SIZE 4096
+#define RECORD_CHUNK_RECORDS (1 << 20) // 16 MB
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t t_start_ns;          // CLOCK_MONOTONIC time of the start of the recording
+    _Atomic uint64_t n_records;   // records written so far
+    uint32_t n_ports;             // size of the port table
+    uint32_t writing_port;        // trigger port (from 1), 0 if none
+} RecordHeader;
+
+typedef struct
+{
+    uint64_t t_ns;     // CLOCK_MONOTONIC time of the read that saw the new value
+    uint32_t run;      // number of samples of the previous value (0 for the first value of a pin set), a run
+                       // reaching UINT32_MAX is closed by a record that repeats the value (see recordLoop)
+    uint8_t port;      // from 1, order of the port table
+    uint8_t reg;       // 0 = STATUS, 1 = DATA
+    uint8_t value;
+    uint8_t reserved;
+} RecordEntry;
+
+static pthread_t record_thread;
+static int record_thread_running = 0;
+static atomic_int record_quit = 0;
+static uint64_t record_period_ns = 0; // 0 = poll continuously
+static int record_fd = -1;
+static RecordHeader *record_header = NULL;
+static RecordEntry *record_chunk = NULL;
+static uint64_t record_n = 0;         // written by the record thread only
+static int record_error = 0;          // errno that stopped the record thread
+static char record_path[PATH_MAX];
+#ifdef PPMEG_DAEMON
+static char daemon_dir[PATH_MAX]; // directory of the socket of the daemon, the record files of its clients go there
+#endif
+
+// publication of the triggers and of the events in a POSIX shared-memory ring for the other processes of the PC
+// (layout in ppMEG_shm.h). shm_users counts the writers using the mapping, it is unmapped once they are done.
+static PPMEGShmHeader *_Atomic shm_header = NULL;
+static atomic_int shm_users = 0;
+static char shm_name[NAME_MAX + 1];
+
+// connection to the ppMEG daemon (ppMEGd, messages in ppMEG_wire.h): once connected, every call is sent to the
+// daemon, which owns the ports and runs the threads outside Matlab
+static int daemon_fd = -1;
+static WireBuffer daemon_buffer; // kept from one call to the next
+
+// precision wait: clock_nanosleep until wait_margin_ns before the deadline, then spin on the clock
+// the margin is calibrated when the ports are opened (WAIT_MARGIN_MIN_NS..WAIT_MARGIN_MAX_NS) or set by the user
+#define WAIT_MAX_SLEEP_NS 50000000 // the sleeps of the threads are split so that they can be stopped quickly
+#define WAIT_MARGIN_MIN_NS 20000
+#define WAIT_MARGIN_MAX_NS 2000000
+static uint64_t wait_margin_ns = 200000;
+
+// real-time settings of the threads of the MEX, applied when a thread starts and by 'rtconfig'
+#define WORKER_STACK_PREFAULT (64 * 1024) // part of the stack touched when a thread starts
+static int rt_priority = 0; // SCHED_FIFO priority, 0 = default scheduling (SCHED_OTHER)
+static int rt_cpu = -1;     // CPU the threads are pinned to, -1 = any
+static int rt_lock = 0;     // 1 = lock the stacks and buffers of ppMEG, 2 = mlockall (all Matlab memory)
+
+typedef struct
+{
+    const char *name;
+    pthread_t *thread;
+    int *running;
+} Worker;
+
+static const Worker workers[] = {{"pulse", &pulse_thread, &pulse_thread_running},
+                                 {"events", &event_thread, &event_thread_running},
+                                 {"schedule", &schedule_thread, &schedule_thread_running},
+                                 {"queue", &queue_thread, &queue_thread_running},
+                                 {"record", &record_thread, &record_thread_running},
+                                 {"train", &train_thread, &train_thread_running}};
 
 void PrintHelp()
 {
     mexPrintf("parallelport usage : \n");
     mexPrintf("parallelport('open', port_address)  : opens the device at the specified address \n");
+    mexPrintf("parallelport('open'[, port_address], backend) : same with the 'ppdev' (default), 'ioport' or 'sim' backend \n");
+    mexPrintf("parallelport('open', {addresses}[, roles]) : opens a table of ports, roles = 'i'/'o'/'b' per port \n");
+    mexPrintf("parallelport('open', 'discover'[, roles]) : opens every /dev/parport* (response ports by default) \n");
     mexPrintf("parallelport('write',message)       : sends the message = {0, 1, 2, ..., 255} uint8 \n");
-    mexPrintf("parallelport('read')                : reads the value currently set in the port \n");
+    mexPrintf("parallelport('queue',hold_us)       : 'write' queues the messages, each one is held hold_us at least \n");
+    mexPrintf("parallelport('queue'[,'stop'])      : state of the write queue (or writes what is left and stops it) \n");
+    mexPrintf("parallelport('set'|'clear'|'toggle',mask) : sets / clears / inverts the DATA bits of the mask \n");
+    mexPrintf("parallelport(message)               : same as parallelport('write',message) \n");
+    mexPrintf("parallelport('read')                : reads the value currently set in the response ports \n");
+    mexPrintf("parallelport('decode',ports,bits)   : 'read'/'events'/'waitresponse' return the given STATUS bits only \n");
+    mexPrintf("parallelport('pulse',message,width) : sends the message and resets to 0 after width us \n");
+    mexPrintf("parallelport('pulse',msg,width,mask): same on the bits of the mask only, pulses on other bits overlap \n");
+    mexPrintf("parallelport('events','start'|'stop'): starts/stops the polling of the STATUS pins \n");
+    mexPrintf("parallelport('events','start','irq'): waits for the nACK interrupts instead of polling \n");
+    mexPrintf("parallelport('events'[, 'native'])  : returns the STATUS changes since the last call (double or uint8/uint64 ns) \n");
+    mexPrintf("parallelport('sim', setting, ...)   : latency / jitter / status / loopback of the simulated ports \n");
+    mexPrintf("parallelport('now')                 : current time of the clock used by ppMEG (s) \n");
+    mexPrintf("parallelport('log'[, 'reset'|'native']) : returns (or clears) the log of the writes \n");
+    mexPrintf("parallelport('record',file|'stop')  : records all the changes of the pins in a file (ppMEG_readrecord) \n");
+    mexPrintf("parallelport('share',name|'stop')   : publishes the triggers and events in shared memory (ppMEG_shm.h) \n");
+    mexPrintf("parallelport('stats'[, 'reset'])    : percentiles of the access durations / lateness / intervals \n");
+    mexPrintf("parallelport('rtconfig', ...)       : priority / cpu / lock settings of the threads of the MEX \n");
+    mexPrintf("parallelport('waituntil', t)        : precision wait until t (s), returns the overshoot (s) \n");
+    mexPrintf("parallelport('waituntil','margin'[,us]) : sets (or returns) the part of the waits spent spinning (20 us - 2 ms) \n");
+    mexPrintf("parallelport('waitresponse',mask,timeout) : waits for a change of the masked STATUS bits \n");
+    mexPrintf("parallelport('capture',ports,n)     : reads the STATUS of the ports n times in a row (uint8, uint64 ns) \n");
+    mexPrintf("parallelport('rule',port,bit,code)  : the events thread writes code when the bit goes high (once per arming) \n");
+    mexPrintf("parallelport('rule','arm'|'disarm'|'clear') : arms / disarms / removes the rules \n");
+    mexPrintf("parallelport('schedule',times,msgs) : writes the messages at the given times (s) from a thread \n");
+    mexPrintf("parallelport('schedule')            : lateness of each message of the sequence (s) \n");
+    mexPrintf("parallelport('train',mask,period,width[,n]) : n pulses (0 = until stopped) on the bits of the mask (us) \n");
+    mexPrintf("parallelport('train'[,'stop'])      : achieved periods of the pulse train (or stops it) \n");
+    mexPrintf("parallelport('connect'[, socket])   : sends every call to the ppMEG daemon (ppMEGd) \n");
+    mexPrintf("parallelport('disconnect')          : back to the ports of this process \n");
     mexPrintf("parallelport('close')               : closes the device \n");
     mexPrintf("\n");
 }
 
 /**
- * Returns the file descriptor of the port
+ * Returns the current CLOCK_MONOTONIC time in nanoseconds
  *
- * Open the device/file, then claim access, so we are ready to send messages
- * Takes the port address as an argument
+ * This is the clock used for every timestamp returned by ppMEG (converted to seconds on the Matlab side)
  * */
-int openPort(char *pp_address)
+uint64_t monotonicNs(void)
 {
-    int pport;
-    pport = open(pp_address, O_RDWR); /* Open the device/file */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
 
-    /* File opened ? */
-    if (pport < 0)
-        mexErrMsgTxt("Couldn't open parallel port (user have permission on the device ? user in the good group ?) \n");
+/**
+ * Precision wait until an absolute CLOCK_MONOTONIC time, used by every timed feature of the MEX
+ *
+ * Sleeps with clock_nanosleep until wait_margin_ns before the deadline, then spins on the clock.
+ * If quit is given, the sleep is split in steps of WAIT_MAX_SLEEP_NS and the wait stops as soon as *quit is set
+ * (also during the spin).
+ * Returns the overshoot (ns after the deadline), or -1 if the wait was stopped by quit.
+ * */
+int64_t waitUntil(uint64_t deadline_ns, atomic_int *quit)
+{
+    struct timespec ts;
+    uint64_t now, wake_up;
 
-    /* Claim access */
-    if (ioctl(pport, PPCLAIM) < 0)
+    for (now = monotonicNs(); now + wait_margin_ns < deadline_ns; now = monotonicNs())
     {
-        mexPrintf("PPCLAIM ioctl Error : %s (%d)\n", strerror(errno), errno);
-        mexErrMsgTxt("PPCLAIM ioctl Error");
+        if (quit != NULL && atomic_load_explicit(quit, memory_order_relaxed))
+            return -1;
+        wake_up = deadline_ns - wait_margin_ns;
+        if (quit != NULL && wake_up > now + WAIT_MAX_SLEEP_NS)
+            wake_up = now + WAIT_MAX_SLEEP_NS;
+        ts.tv_sec = wake_up / 1000000000ull;
+        ts.tv_nsec = wake_up % 1000000000ull;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+    while (now < deadline_ns)
+    {
+        if (quit != NULL && atomic_load_explicit(quit, memory_order_relaxed))
+            return -1;
+        now = monotonicNs();
+    }
+    if (quit != NULL && atomic_load_explicit(quit, memory_order_relaxed))
+        return -1;
+    return (int64_t)(now - deadline_ns);
+}
+
+/**
+ * Measure how late clock_nanosleep wakes up on this computer and set the spinning margin of waitUntil
+ *
+ * The margin is 1.5 times the worst wake-up delay of a few short sleeps, within WAIT_MARGIN_MIN/MAX_NS.
+ * */
+void calibrateWait(void)
+{
+    struct timespec ts;
+    uint64_t deadline, worst = 0;
+
+    for (int k = 0; k < 20; k++)
+    {
+        deadline = monotonicNs() + 100000;
+        ts.tv_sec = deadline / 1000000000ull;
+        ts.tv_nsec = deadline % 1000000000ull;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        if (monotonicNs() - deadline > worst)
+            worst = monotonicNs() - deadline;
     }
 
-    mexPrintf("Parallel %s opened successfully \n", pp_address);
+    wait_margin_ns = worst * 3 / 2;
+    if (wait_margin_ns < WAIT_MARGIN_MIN_NS)
+        wait_margin_ns = WAIT_MARGIN_MIN_NS;
+    if (wait_margin_ns > WAIT_MARGIN_MAX_NS)
+        wait_margin_ns = WAIT_MARGIN_MAX_NS;
+}
+
+/**
+ * ppdev backend : one ioctl per access
+ * */
+int ppdevOpen(ParPort *port, const char *address)
+{
+    port->fd = open(address, O_RDWR); /* Open the device/file */
+    return port->fd < 0 ? errno : 0;
+}
+
+int ppdevClaim(ParPort *port)
+{
+    return ioctl(port->fd, PPCLAIM) < 0 ? errno : 0;
+}
+
+int ppdevWriteData(ParPort *port, unsigned char value)
+{
+    return ioctl(port->fd, PPWDATA, &value) < 0 ? errno : 0;
+}
+
+int ppdevReadData(ParPort *port, unsigned char *value)
+{
+    return ioctl(port->fd, PPRDATA, value) < 0 ? errno : 0;
+}
 
-    return pport;
+int ppdevReadStatus(ParPort *port, unsigned char *value)
+{
+    // ioctl is using pointers: no returned value, argument is passed by ref.
+    return ioctl(port->fd, PPRSTATUS, value) < 0 ? errno : 0;
 }
 
-/*************************************************************************/
-/* Send message : an int between 0 and 255 (i.e. a char in C)
-/*************************************************************************/
-void writePort(const unsigned char *message, int pport)
+int ppdevRelease(ParPort *port)
 {
-    if (pport > 0)
+    int err = 0;
+
+    if (ioctl(port->fd, PPRELEASE) < 0) /* Release access */
     {
-        if (ioctl(pport, PPWDATA, message) < 0)
-        {
-            mexPrintf("PPWDATA ioctl Error : %s (%d)\n", strerror(errno), errno);
-            mexErrMsgTxt("PPWDATA ioctl Error \n");
-        }
+        err = errno;
+        mexPrintf("PPRELEASE ioctl Error (with pport = %d): %s (%d)\n", port->fd, strerror(errno), errno);
     }
-    else
-        mexErrMsgTxt("Parallel port was not opened \n");
+    if (close(port->fd) < 0) /* Close file */
+    {
+        err = errno;
+        mexPrintf("Close Error (with pport = %d): %s (%d)\n", port->fd, strerror(errno), errno);
+    }
+    port->fd = -1;
+
+    return err;
 }
 
+static const PortBackend ppdev_backend = {"ppdev", ppdevOpen, ppdevClaim, ppdevWriteData, ppdevReadData,
+                                          ppdevReadStatus, ppdevRelease};
+
 /**
- * Read message : an int between 0 and 255 (i.e. a char in C)
- * Use the STATUS pins
- *
- * No use returned value, use pointers for consistency with the writePort function 
+ * ioport backend : outb/inb on the registers, no syscall per access
+ * */
+
+/**
+ * The device stays opened and claimed through ppdev (so that no other driver uses it). Requires root
+ * (or CAP_SYS_RAWIO). The permission is inherited by the threads created afterwards, the threads are
+ * always (re)started after 'open'.
  * */
-void readPort(unsigned char *data, int pport)
+int ioportOpen(ParPort *port, const char *address)
 {
-    if (pport > 0)
+    const char *name = strrchr(address, '/');
+    char path[300];
+    unsigned int base = 0;
+    FILE *f;
+
+    // the base address is the first value of /proc/sys/dev/parport/parport<N>/base-addr
+    snprintf(path, sizeof(path), "/proc/sys/dev/parport/%s/base-addr", name != NULL ? name + 1 : address);
+    f = fopen(path, "r");
+    if (f == NULL || fscanf(f, "%u", &base) != 1 || base == 0)
     {
-        // ioctl is using pointers: no returned value, argument is passed by ref.
-        if (ioctl(pport, PPRSTATUS, data) < 0)
-        {
-            mexPrintf("PPRSTATUS ioctl Error : %s (%d)\n", strerror(errno), errno);
-            mexErrMsgTxt("PPRSTATUS ioctl Error \n");
-        }
+        if (f != NULL)
+            fclose(f);
+        mexPrintf("Couldn't read the base address of %s in %s\n", address, path);
+        return ENODEV;
     }
-    else
-        mexErrMsgTxt("Parallel port was not opened \n");
+    fclose(f);
+    port->base = (unsigned short)base;
+
+    return ppdevOpen(port, address);
+}
+
+int ioportClaim(ParPort *port)
+{
+    int err = ppdevClaim(port);
+
+    if (err != 0)
+        return err;
+
+    // DATA, STATUS and CONTROL registers
+    if (ioperm(port->base, 3, 1) < 0)
+    {
+        err = errno;
+        mexPrintf("ioperm Error (base = 0x%x, root is required): %s (%d)\n", port->base, strerror(errno), errno);
+        ioctl(port->fd, PPRELEASE);
+        return err;
+    }
+    mexPrintf("I/O address 0x%x \n", port->base);
+
+    return 0;
+}
+
+int ioportWriteData(ParPort *port, unsigned char value)
+{
+    outb(value, port->base);
+    return 0;
+}
+
+int ioportReadData(ParPort *port, unsigned char *value)
+{
+    *value = inb(port->base); // DATA latch, as PPRDATA
+    return 0;
+}
+
+int ioportReadStatus(ParPort *port, unsigned char *value)
+{
+    *value = inb(port->base + 1); // same raw STATUS register as PPRSTATUS
+    return 0;
 }
 
+int ioportRelease(ParPort *port)
+{
+    ioperm(port->base, 3, 0);
+    port->base = 0;
+    return ppdevRelease(port);
+}
+
+static const PortBackend ioport_backend = {"ioport", ioportOpen, ioportClaim, ioportWriteData, ioportReadData,
+                                           ioportReadStatus, ioportRelease};
+
 /**
- * Use the port descriptor to clean it up (on exit or to avoid repeted openings)
- *
- * Always return 0 (or raise an error if the port was not successfully closed).
- * Do nothing if the port was not opened. 
+ * sim backend : in-process port with a configurable access time
+ * */
+
+/**
+ * Each access spins for sim_latency_ns plus a uniform jitter in [0, sim_jitter_ns].
+ * The STATUS pins follow a script (values with their CLOCK_MONOTONIC times) or the DATA pins of another
+ * simulated port (loopback), so that every feature can be measured without hardware.
  * */
-int unloadPort(int pport)
+void simDelay(void)
+{
+    static __thread uint64_t seed = 0;
+    uint64_t deadline = monotonicNs() + sim_latency_ns;
+
+    if (sim_jitter_ns > 0)
+    {
+        // xorshift64, one state per thread
+        if (seed == 0)
+            seed = deadline | 1;
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        deadline += seed % (sim_jitter_ns + 1);
+    }
+    while (monotonicNs() < deadline)
+        ;
+}
+
+int simOpen(ParPort *port, const char *address)
+{
+    (void)address;
+    port->fd = -1;
+    atomic_store(&port->sim_data, 0);
+    port->sim_status = 0;
+    port->sim_loopback = -1;
+    return 0;
+}
+
+int simClaim(ParPort *port)
+{
+    (void)port;
+    return 0;
+}
+
+int simWriteData(ParPort *port, unsigned char value)
+{
+    simDelay();
+    atomic_store_explicit(&port->sim_data, value, memory_order_release);
+    return 0;
+}
+
+int simReadData(ParPort *port, unsigned char *value)
+{
+    simDelay();
+    *value = atomic_load_explicit(&port->sim_data, memory_order_acquire);
+    return 0;
+}
+
+int simReadStatus(ParPort *port, unsigned char *value)
 {
-    if (pport > 0)
+    uint64_t t;
+    size_t lo, hi, mid;
+
+    simDelay();
+    if (port->sim_loopback >= 0)
+    {
+        *value = atomic_load_explicit(&pports[port->sim_loopback].sim_data, memory_order_acquire);
+        return 0;
+    }
+
+    pthread_mutex_lock(&sim_mutex);
+    *value = port->sim_status;
+    if (port->sim_script_n > 0)
     {
-        if (ioctl(pport, PPRELEASE) < 0) /* Release access */
+        // last scripted value whose time is reached
+        t = monotonicNs();
+        lo = 0;
+        hi = port->sim_script_n;
+        while (lo < hi)
         {
-            mexPrintf("PPRELEASE ioctl Error (with pport = %d): %s (%d)\n", pport, strerror(errno), errno);
-            mexErrMsgTxt("PPRELEASE ioctl Error\n");
+            mid = (lo + hi) / 2;
+            if (port->sim_script_t[mid] <= t)
+                lo = mid + 1;
+            else
+                hi = mid;
         }
+        if (lo > 0)
+            *value = port->sim_script_status[lo - 1];
+    }
+    pthread_mutex_unlock(&sim_mutex);
+
+    return 0;
+}
+
+/**
+ * Replace the STATUS script of a simulated port (NULL times : constant value status[0])
+ * */
+void setSimScript(ParPort *port, const uint64_t *t_ns, const unsigned char *status, size_t n)
+{
+    uint64_t *new_t = NULL;
+    unsigned char *new_status = NULL;
 
-        if (close(pport) < 0) /* Close file */
+    if (t_ns != NULL && n > 0)
+    {
+        new_t = malloc(n * sizeof(uint64_t));
+        new_status = malloc(n);
+        if (new_t == NULL || new_status == NULL)
         {
-            mexPrintf("Close Error (with pport = %d): %s (%d)\n", pport, strerror(errno), errno);
-            mexErrMsgTxt("Close Error\n");
+            free(new_t);
+            free(new_status);
+            mexErrMsgTxt("Couldn't allocate the STATUS script \n");
         }
-
-        pport = 0;
-        mexPrintf("Parallel port has been closed \n");
+        memcpy(new_t, t_ns, n * sizeof(uint64_t));
+        memcpy(new_status, status, n);
     }
 
-    return pport;
+    pthread_mutex_lock(&sim_mutex);
+    free(port->sim_script_t);
+    free(port->sim_script_status);
+    port->sim_script_t = new_t;
+    port->sim_script_status = new_status;
+    port->sim_script_n = new_t != NULL ? n : 0;
+    if (new_t == NULL && n > 0)
+        port->sim_status = status[0];
+    pthread_mutex_unlock(&sim_mutex);
 }
 
-void unloadAll(void)
+int simRelease(ParPort *port)
 {
-    for (int i = 0; i < 3; i++)
-        pports[i] = unloadPort(pports[i]);
+    setSimScript(port, NULL, NULL, 0);
+    return 0;
 }
 
+static const PortBackend sim_backend = {"sim", simOpen, simClaim, simWriteData, simReadData, simReadStatus,
+                                        simRelease};
+
+static const PortBackend *backends[] = {&ppdev_backend, &ioport_backend, &sim_backend};
+
 /**
- * Entry point (equivalent to the main() function in regular C)
+ * Open the device/file, then claim access, so we are ready to send messages
  *
- * The left hand side parameters (lhs) are the output of the function directly in Matlab
- * The right hand side parameters (rhs) are the inputs arguments from the Matlab call
+ * Takes the port address and the backend as arguments
  * */
-void mexFunction(int nlhs, mxArray *plhs[],
-                 int nrhs, const mxArray *prhs[])
+void openPort(ParPort *port, const char *pp_address, const PortBackend *backend)
 {
-    char *action;
-    unsigned char message = 0;
-    char *user_address; // used only if user gives an address to the open mex function
+    int err;
 
-    // if no input argument, display help
-    if (nrhs == 0)
+    err = backend->open(port, pp_address);
+    /* File opened ? */
+    if (err != 0)
     {
-        PrintHelp();
-        return;
+        mexPrintf("Open Error on %s (%s backend): %s (%d)\n", pp_address, backend->name, strerror(err), err);
+        mexErrMsgTxt("Couldn't open parallel port (user have permission on the device ? user in the good group ?) \n");
     }
 
-    // Determine what the user is requesting
-    // Only the first letter is used to allow abbreviation
-    action = mxArrayToString(prhs[0]);
+    /* Claim access */
+    err = backend->claim(port);
+    if (err != 0)
+    {
+        if (port->fd >= 0)
+            close(port->fd);
+        port->fd = -1;
+        mexPrintf("PPCLAIM ioctl Error : %s (%d)\n", strerror(err), err);
+        mexErrMsgTxt("PPCLAIM ioctl Error");
+    }
 
-    switch (action[0])
+    // current DATA pins, the starting point of the bit operations ('set', 'clear', 'toggle')
     {
-    case 'o': // ppMEG('open'[, 'port_address'])
-        if (nrhs == 1)
-        {
-            // no port address specified : closing then reopening all ports
-            for (int i = 0; i < sizeof(addresses) / sizeof(addresses[0]); i++)
-            {
-                pports[i] = unloadPort(pports[i]);
-                pports[i] = openPort(addresses[i]);
-            }
-        }
-        else if (nrhs == 2)
-        {
-            // the user specifies an address that overwrites the default declared in static
-            use_multiple_ports = 0;
-            user_address = mxArrayToString(prhs[1]);
-            writing_port_idx = 0;
-            pports[0] = unloadPort(pports[0]);
-            pports[0] = openPort(user_address);
-        }
-        else
-        {
-            mexErrMsgTxt("Incorrect number of arguments.");
-        }
-        break;
+        unsigned char data = 0;
+        backend->read_data(port, &data);
+        atomic_store(&port->data, data);
+    }
 
-    case 'w': // ppMEG('write', message)
-        if (nrhs != 2)
-            mexErrMsgTxt("You need to specify the message to send [0-255]");
+    port->backend = backend;
+    mexPrintf("Parallel %s opened successfully (%s) \n", pp_address, backend->name);
+}
 
-        message = (unsigned char)mxGetScalar(prhs[1]); // Fetch the input value
-        writePort(&message, pports[writing_port_idx]);
+/**
+ * Raise a Matlab error if a port operation failed
+ *
+ * writePort and readPort only return an errno so that they can be used from the background threads
+ * (the MEX API must only be called from the Matlab thread).
+ * */
+void checkPort(int err, const char *ioctl_name)
+{
+    char msg[64];
 
-        break;
+    if (err == 0)
+        return;
+    if (err == EBADF)
+        mexErrMsgTxt("Parallel port was not opened \n");
+    if (err == ENOBUFS)
+        mexErrMsgTxt("The write queue is full \n");
 
-    case 'r': // ppMEG('read')
-        if (nrhs != 1)
-            mexErrMsgTxt("Error calling read: no argument should be given");
+    mexPrintf("%s ioctl Error : %s (%d)\n", ioctl_name, strerror(err), err);
+    snprintf(msg, sizeof(msg), "%s ioctl Error \n", ioctl_name);
+    mexErrMsgTxt(msg);
+}
 
-        // assign output message to the array of left-side arguments
-        // for sake of simplicity, char is cast to double value
-        if (use_multiple_ports)
-        {
-            for (int i = 0; i < 3; i++)
-            {
-                readPort(&message, pports[i]);
-                // fill-in the left-hand side array with each value read
-                plhs[i] = mxCreateDoubleScalar(message);
-            }
-        }
-        else
-        {
-            readPort(&message, pports[0]);
-            plhs[0] = mxCreateDoubleScalar(message);
-        }
+/**
+ * Index of the histogram bucket of a value
+ *
+ * The values below HIST_SUB_BUCKETS have their own bucket, the others are bucketed by their HIST_SUB_BITS + 1
+ * most significant bits.
+ * */
+static inline int histogramBucket(uint64_t value)
+{
+    int exponent;
 
-        break;
+    if (value < HIST_SUB_BUCKETS)
+        return (int)value;
+    exponent = 63 - __builtin_clzll(value); // >= HIST_SUB_BITS
+    return (exponent - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+           (int)((value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
 
-    case 'c': // ppMEG('close')
-        if (nrhs != 1)
-            mexErrMsgTxt("Error calling close: no argument should be given");
-        unloadAll();
-        // resetting default values of global variables in case ppMEG is called again in the same
-        // MATLAB workspace
-        use_multiple_ports = 1;
-        writing_port_idx = 1;
-        break;
+/* smallest value of a bucket, and its width */
+static inline uint64_t histogramBucketStart(int bucket, uint64_t *width)
+{
+    int exponent = bucket / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
 
-    default:
-        mexErrMsgTxt("No valid action specified : o / w / r / c");
+    if (bucket < 2 * HIST_SUB_BUCKETS)
+    {
+        *width = 1;
+        return (uint64_t)bucket;
     }
+    *width = 1ULL << (exponent - HIST_SUB_BITS);
+    return (1ULL << exponent) + (uint64_t)(bucket % HIST_SUB_BUCKETS) * *width;
+}
 
-    /* Make sure device is released when MEX-file is cleared */
-    mexAtExit(unloadAll);
+static inline void atomicMax(atomic_uint_fast64_t *target, uint64_t value)
+{
+    uint_fast64_t current = atomic_load_explicit(target, memory_order_relaxed);
+
+    while (value > current &&
+           !atomic_compare_exchange_weak_explicit(target, &current, value, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+/**
+ * Add a value (in ns) to a histogram (any thread)
+ * */
+static inline void histogramRecord(Histogram *histogram, uint64_t value)
+{
+    atomic_fetch_add_explicit(&histogram->buckets[histogramBucket(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum_ns, value, memory_order_relaxed);
+    atomicMax(&histogram->max_ns, value);
+    atomicMax(&histogram->min_inv_ns, ~value);
+}
+
+void histogramReset(Histogram *histogram)
+{
+    for (int k = 0; k < HIST_BUCKETS; k++)
+        atomic_store_explicit(&histogram->buckets[k], 0, memory_order_relaxed);
+    atomic_store(&histogram->count, 0);
+    atomic_store(&histogram->sum_ns, 0);
+    atomic_store(&histogram->max_ns, 0);
+    atomic_store(&histogram->min_inv_ns, 0);
+}
+
+/**
+ * Value (in ns) below which a fraction p of the recorded values are
+ *
+ * Returns the middle of the bucket holding the value, bounded by the min and the max. The histogram must not be
+ * empty; the values recorded while reading it may or may not be taken into account.
+ * */
+uint64_t histogramPercentile(const Histogram *histogram, double p)
+{
+    uint64_t count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    uint64_t min = ~atomic_load_explicit(&histogram->min_inv_ns, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&histogram->max_ns, memory_order_relaxed);
+    uint64_t rank = (uint64_t)(p * count), seen = 0, start = max, width = 0;
+
+    for (int k = 0; k < HIST_BUCKETS; k++)
+    {
+        seen += atomic_load_explicit(&histogram->buckets[k], memory_order_relaxed);
+        if (seen > rank)
+        {
+            start = histogramBucketStart(k, &width) + width / 2;
+            break;
+        }
+    }
+    return start < min ? min : start > max ? max : start;
+}
+
+/**
+ * Add a write to the log (any thread)
+ * */
+void logWrite(int idx, unsigned char value, uint64_t t_before_ns, uint64_t t_after_ns)
+{
+    uint_fast64_t seq = atomic_fetch_add_explicit(&write_log_seq, 1, memory_order_relaxed);
+    size_t i = seq & (WRITE_LOG_SIZE - 1);
+
+    atomic_store_explicit(&write_log.done_seq[i], 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    write_log.t_before_ns[i] = t_before_ns;
+    write_log.t_after_ns[i] = t_after_ns;
+    write_log.port[i] = idx + 1;
+    write_log.value[i] = value;
+    atomic_store_explicit(&write_log.done_seq[i], seq + 1, memory_order_release);
+}
+
+/**
+ * Publish a trigger or an event in the shared-memory ring, if any (any thread)
+ *
+ * The record is claimed on the head of the ring, then written between the two stores of its seq (ppMEG_shm.h).
+ * */
+void publishShared(int kind, int idx, unsigned char old_value, unsigned char value, uint64_t t_ns)
+{
+    PPMEGShmHeader *header;
+
+    if (atomic_load_explicit(&shm_header, memory_order_relaxed) == NULL)
+        return;
+    atomic_fetch_add(&shm_users, 1);
+    header = atomic_load(&shm_header);
+    if (header != NULL)
+    {
+        uint64_t n = atomic_fetch_add_explicit(&header->head, 1, memory_order_relaxed);
+        PPMEGShmRecord *record = &ppMEGShmRecords(header)[n & (PPMEG_SHM_CAPACITY - 1)];
+
+        atomic_store_explicit(&record->seq, 2 * n + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        record->t_ns = t_ns;
+        record->kind = kind;
+        record->port = idx + 1;
+        record->old_value = old_value;
+        record->value = value;
+        atomic_store_explicit(&record->seq, 2 * n + 2, memory_order_release);
+    }
+    atomic_fetch_sub_explicit(&shm_users, 1, memory_order_release);
+}
+
+/**
+ * Send message : an int between 0 and 255 (i.e. a char in C)
+ *
+ * Takes the index of the port in pports[] (-1 if there is no trigger port).
+ * Returns 0 on success, EBADF if the port was not opened or the errno of the backend.
+ * The successful writes are timestamped and logged, without any additional syscall (vDSO clock).
+ * A trigger (a write that sets bits: 'w', pulses, sequences, rules, ...) of a non-zero value is also the start
+ * of the reaction times of 'waitresponse'; the resets of the pulses and the edges of the train are not.
+ * */
+int writePort(const unsigned char *message, int idx, int trigger)
+{
+    ParPort *port = idx >= 0 ? &pports[idx] : NULL;
+    uint64_t t_before;
+    int err;
+
+    if (port == NULL || port->backend == NULL)
+        return EBADF;
+    t_before = monotonicNs();
+    err = port->backend->write_data(port, *message);
+    if (err == 0)
+    {
+        uint64_t t_after = monotonicNs();
+        unsigned char old_value = atomic_exchange_explicit(&port->data, *message, memory_order_relaxed);
+        publishShared(PPMEG_SHM_TRIGGER, idx, old_value, *message, t_after);
+        logWrite(idx, *message, t_before, t_after);
+        histogramRecord(&port->write_hist, t_after - t_before);
+        if (trigger && *message != 0)
+            atomic_store_explicit(&last_trigger_ns, t_after, memory_order_relaxed);
+    }
+    return err;
+}
+
+/**
+ * Cancel the pending resets of the given bits of the pulse port (data_mutex held)
+ *
+ * The last pulse ends (pulse_low_ns) when none of its bits is pending anymore.
+ * */
+void cancelPulseBits(unsigned char bits)
+{
+    unsigned char ended = 0;
+
+    for (int b = 0; b < 8; b++)
+    {
+        if ((bits & (1 << b)) && pulse_deadlines[b] != 0)
+        {
+            ended |= 1 << b;
+            pulse_deadlines[b] = 0;
+        }
+    }
+    if (!(ended & pulse_mask))
+        return;
+    for (int b = 0; b < 8; b++)
+        if ((pulse_mask & (1 << b)) && pulse_deadlines[b] != 0)
+            return;
+    pulse_low_ns = monotonicNs();
+}
+
+/**
+ * Body of modifyData (data_mutex held)
+ * */
+int modifyDataLocked(unsigned char keep, unsigned char flip, int idx, unsigned char *value)
+{
+    unsigned char data, reserved;
+    int err;
+
+    if (idx < 0 || pports[idx].backend == NULL)
+        return EBADF;
+    reserved = idx == train_port_idx ? atomic_load_explicit(&train_reserved, memory_order_relaxed) : 0;
+    keep |= reserved;
+    flip &= ~reserved;
+    data = (atomic_load_explicit(&pports[idx].data, memory_order_relaxed) & keep) ^ flip;
+    err = writePort(&data, idx, flip != 0);
+    if (err == 0 && idx == pulse_port_idx)
+        cancelPulseBits(~keep);
+    if (value != NULL)
+        *value = data;
+    return err;
+}
+
+/**
+ * Write (shadow & keep) ^ flip on a port: one write, whatever the number of bits changed
+ *
+ * The shadow is the last value written on the port. Every writer of the DATA pins goes through this function
+ * (a full value is keep = 0, flip = value), data_mutex makes the read-modify-write atomic with the write.
+ * The bits reserved by a running pulse train are kept whatever keep and flip (only writeTrain changes them).
+ * The bits overwritten (not in keep) lose their pending pulse reset: e.g. a 'w' during a pulse stays on the
+ * port, it is not cut by the reset of the older pulse.
+ * A write with flip != 0 is a trigger for the reaction times (see writePort).
+ * Returns 0 or an errno (see writePort), the value written in *value if not NULL.
+ * */
+int modifyData(unsigned char keep, unsigned char flip, int idx, unsigned char *value)
+{
+    int err;
+
+    pthread_mutex_lock(&data_mutex);
+    err = modifyDataLocked(keep, flip, idx, value);
+    pthread_mutex_unlock(&data_mutex);
+    return err;
+}
+
+/**
+ * Read message : an int between 0 and 255 (i.e. a char in C)
+ * Use the STATUS pins
+ *
+ * The value is returned in *data, the return value is the status of the read (as for writePort).
+ * Takes the index of the port in pports[].
+ * Returns 0 on success, EBADF if the port was not opened or the errno of the backend.
+ * The duration of the successful reads is added to the statistics.
+ * */
+int readPort(unsigned char *data, int idx)
+{
+    ParPort *port = &pports[idx];
+    uint64_t t_before;
+    int err;
+
+    if (port->backend == NULL)
+        return EBADF;
+    t_before = monotonicNs();
+    err = port->backend->read_status(port, data);
+    if (err == 0)
+        histogramRecord(&port->read_hist, monotonicNs() - t_before);
+    return err;
+}
+
+/**
+ * Read the STATUS pins of a response port and decode them with the table of the port
+ *
+ * Returns 0 or an errno (see readPort).
+ * */
+int readButtons(unsigned char *value, int idx)
+{
+    int err = readPort(value, idx);
+
+    if (err == 0)
+        *value = pports[idx].decode[*value];
+    return err;
+}
+
+/**
+ * Set the decode table of a port: bit k of the decoded value is the STATUS bit bits[k] of the raw value, after
+ * inversion of the bits of invert (n = 0: raw value, identity table)
+ * */
+void setDecodeTable(ParPort *port, const int *bits, int n, unsigned char invert)
+{
+    unsigned char table[256];
+
+    for (int raw = 0; raw < 256; raw++)
+    {
+        unsigned char value = raw ^ invert;
+
+        table[raw] = n == 0 ? value : 0;
+        for (int k = 0; k < n; k++)
+            table[raw] |= ((value >> bits[k]) & 1) << k;
+    }
+    // the table can be changed while the event thread uses it: it sees the old or the new value of each entry
+    memcpy(port->decode, table, sizeof(table));
+}
+
+/**
+ * Lock (or unlock) the stack of a thread in memory
+ *
+ * Returns 0 or an errno.
+ * */
+int lockThreadStack(pthread_t thread, int lock)
+{
+    pthread_attr_t attr;
+    void *stack;
+    size_t size;
+    int err;
+
+    if ((err = pthread_getattr_np(thread, &attr)) != 0)
+        return err;
+    err = pthread_attr_getstack(&attr, &stack, &size);
+    pthread_attr_destroy(&attr);
+    if (err != 0)
+        return err;
+    if ((lock ? mlock(stack, size) : munlock(stack, size)) < 0)
+        return errno;
+    return 0;
+}
+
+/**
+ * Lock (or unlock) the buffers used by the threads in memory, mlock also prefaults them
+ *
+ * Returns 0 or an errno.
+ * */
+int lockBuffers(int lock)
+{
+    int (*lock_fcn)(const void *, size_t) = lock ? mlock : munlock;
+
+    if (lock_fcn(event_t_ns, sizeof(event_t_ns)) < 0 || lock_fcn(event_port, sizeof(event_port)) < 0 ||
+        lock_fcn(event_old, sizeof(event_old)) < 0 || lock_fcn(event_new, sizeof(event_new)) < 0 ||
+        lock_fcn(&write_log, sizeof(write_log)) < 0 ||
+        lock_fcn(write_queue, sizeof(write_queue)) < 0)
+        return errno;
+    if (lock_fcn(pports, sizeof(pports)) < 0)
+        return errno;
+    for (int k = 0; k < sizeof(stats_entries) / sizeof(stats_entries[0]); k++)
+        if (lock_fcn(stats_entries[k].histogram, sizeof(Histogram)) < 0)
+            return errno;
+    if (schedule_n > 0 &&
+        (lock_fcn(schedule_t_ns, schedule_n * sizeof(uint64_t)) < 0 || lock_fcn(schedule_values, schedule_n) < 0 ||
+         lock_fcn(schedule_lateness_ns, schedule_n * sizeof(int64_t)) < 0))
+        return errno;
+    return 0;
+}
+
+/**
+ * Apply the real-time settings (rt_priority, rt_cpu, rt_lock) to a thread
+ *
+ * Each setting is read back: ok[0] (priority), ok[1] (cpu), ok[2] (lock) are set to 0 if it did not take effect
+ * (and the error is appended to msg if given), they are left untouched otherwise.
+ * */
+void applyRtSettings(pthread_t thread, int ok[3], char *msg, size_t msg_size)
+{
+    struct sched_param param;
+    cpu_set_t cpus, actual;
+    int policy, err;
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = rt_priority;
+    err = pthread_setschedparam(thread, rt_priority > 0 ? SCHED_FIFO : SCHED_OTHER, &param);
+    if (err == 0)
+        err = pthread_getschedparam(thread, &policy, &param);
+    if (err != 0 || (rt_priority > 0 && (policy != SCHED_FIFO || param.sched_priority != rt_priority)))
+    {
+        ok[0] = 0;
+        if (msg != NULL)
+            snprintf(msg + strlen(msg), msg_size - strlen(msg), "priority: %s. ", strerror(err ? err : EPERM));
+    }
+
+    // without a CPU, the threads can run on every CPU allowed for the process
+    CPU_ZERO(&cpus);
+    if (rt_cpu >= 0)
+        CPU_SET(rt_cpu, &cpus);
+    else
+        sched_getaffinity(0, sizeof(cpus), &cpus);
+    err = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+    if (err == 0)
+        err = pthread_getaffinity_np(thread, sizeof(actual), &actual);
+    if (err != 0 || !CPU_EQUAL(&cpus, &actual))
+    {
+        ok[1] = 0;
+        if (msg != NULL)
+            snprintf(msg + strlen(msg), msg_size - strlen(msg), "cpu: %s. ", strerror(err ? err : EINVAL));
+    }
+
+    if (rt_lock == 1 && (err = lockThreadStack(thread, 1)) != 0)
+    {
+        ok[2] = 0;
+        if (msg != NULL)
+            snprintf(msg + strlen(msg), msg_size - strlen(msg), "stack lock: %s. ", strerror(err));
+    }
+}
+
+/**
+ * To call first in the body of every thread: touches the stack so that it does not page fault later
+ * */
+void prepareWorkerThread(void)
+{
+    volatile unsigned char stack[WORKER_STACK_PREFAULT];
+
+    for (size_t k = 0; k < sizeof(stack); k += 4096)
+        stack[k] = 0;
+}
+
+/**
+ * Start a thread of the MEX with the real-time settings
+ *
+ * Returns 0 or the error of pthread_create. A setting that cannot be applied is not an error here, 'rtconfig'
+ * reports it.
+ * */
+int startWorker(pthread_t *thread, void *(*body)(void *))
+{
+    int ok[3];
+    int err = pthread_create(thread, NULL, body, NULL);
+
+    if (err == 0)
+        applyRtSettings(*thread, ok, NULL, 0);
+    return err;
+}
+
+void *probeLoop(void *arg)
+{
+    pthread_mutex_t *mutex = arg;
+
+    // blocks until the settings were applied and checked
+    pthread_mutex_lock(mutex);
+    pthread_mutex_unlock(mutex);
+    return NULL;
+}
+
+/**
+ * Apply the real-time settings to the running threads and to a probe thread, then report the result
+ *
+ * The probe thread tells whether the settings take effect even if no thread is running yet.
+ * Returns a struct with the settings and whether each one took effect (priority_ok, cpu_ok, lock_ok).
+ * */
+mxArray *applyRtConfig(void)
+{
+    static const char *fields[] = {"priority", "priority_ok", "cpu", "cpu_ok", "lock", "lock_ok", "message"};
+    static int locked = 0; // lock currently in place
+    pthread_mutex_t probe_mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_t probe;
+    char msg[512] = "";
+    int ok[3] = {1, 1, 1};
+    int err;
+    mxArray *report;
+
+    // memory: undo the previous lock, then lock again with the new setting
+    if (locked == 2)
+        munlockall();
+    else if (locked == 1)
+    {
+        lockBuffers(0);
+        for (int k = 0; k < sizeof(workers) / sizeof(workers[0]); k++)
+            if (*workers[k].running)
+                lockThreadStack(*workers[k].thread, 0);
+    }
+    locked = 0;
+    err = 0;
+    if (rt_lock == 2 && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        err = errno;
+    else if (rt_lock == 1)
+        err = lockBuffers(1);
+    if (err != 0)
+    {
+        ok[2] = 0;
+        snprintf(msg, sizeof(msg), "memory lock: %s. ", strerror(err));
+    }
+    else
+        locked = rt_lock;
+
+    for (int k = 0; k < sizeof(workers) / sizeof(workers[0]); k++)
+        if (*workers[k].running)
+            applyRtSettings(*workers[k].thread, ok, msg, sizeof(msg));
+
+    pthread_mutex_lock(&probe_mutex);
+    if (pthread_create(&probe, NULL, probeLoop, &probe_mutex) == 0)
+    {
+        applyRtSettings(probe, ok, msg, sizeof(msg));
+        pthread_mutex_unlock(&probe_mutex);
+        pthread_join(probe, NULL);
+    }
+    else
+        pthread_mutex_unlock(&probe_mutex);
+
+    report = mxCreateStructMatrix(1, 1, sizeof(fields) / sizeof(fields[0]), fields);
+    mxSetField(report, 0, "priority", mxCreateDoubleScalar(rt_priority));
+    mxSetField(report, 0, "priority_ok", mxCreateLogicalScalar(ok[0]));
+    mxSetField(report, 0, "cpu", mxCreateDoubleScalar(rt_cpu));
+    mxSetField(report, 0, "cpu_ok", mxCreateLogicalScalar(ok[1]));
+    mxSetField(report, 0, "lock", mxCreateDoubleScalar(rt_lock));
+    mxSetField(report, 0, "lock_ok", mxCreateLogicalScalar(ok[2]));
+    mxSetField(report, 0, "message", mxCreateString(msg));
+
+    return report;
+}
+
+/**
+ * Earliest reset deadline of the pending pulses, 0 if none
+ * */
+uint64_t nextPulseDeadline(void)
+{
+    uint64_t deadline = 0;
+
+    pthread_mutex_lock(&data_mutex);
+    for (int b = 0; b < 8; b++)
+        if (pulse_deadlines[b] != 0 && (deadline == 0 || pulse_deadlines[b] < deadline))
+            deadline = pulse_deadlines[b];
+    pthread_mutex_unlock(&data_mutex);
+    return deadline;
+}
+
+/**
+ * Reset the bits whose deadline is before the given time in one write
+ *
+ * The bits are chosen under data_mutex, with the write: the resets cancelled by a write in the meantime are
+ * not done. The reset time of the last pulse is kept once all its bits are back to 0.
+ * */
+void resetPulseBits(uint64_t until_ns)
+{
+    unsigned char bits = 0;
+
+    pthread_mutex_lock(&data_mutex);
+    for (int b = 0; b < 8; b++)
+        if (pulse_deadlines[b] != 0 && pulse_deadlines[b] <= until_ns)
+            bits |= 1 << b;
+    if (bits != 0)
+    {
+        modifyDataLocked(~bits, 0, pulse_port_idx, NULL);
+        cancelPulseBits(bits); // also if the write failed, it is not retried
+    }
+    pthread_mutex_unlock(&data_mutex);
+}
+
+/**
+ * Body of the pulse timer thread
+ *
+ * Sleeps until the earliest reset deadline of the pending pulses (absolute CLOCK_MONOTONIC time), then resets
+ * the bits due at that time. A new pulse written in the meantime wakes the thread up.
+ * */
+void *pulseLoop(void *arg)
+{
+    struct timespec ts;
+    uint64_t deadline;
+
+    (void)arg;
+    prepareWorkerThread();
+    pthread_mutex_lock(&pulse_mutex);
+    while (!pulse_quit)
+    {
+        atomic_store_explicit(&pulse_rearm, 0, memory_order_relaxed);
+        deadline = nextPulseDeadline();
+        if (deadline == 0)
+        {
+            pthread_cond_wait(&pulse_cond, &pulse_mutex);
+            continue;
+        }
+
+        // sleep until the spinning margin of waitUntil, a new pulse or closing wakes the thread up
+        if (monotonicNs() + wait_margin_ns < deadline)
+        {
+            ts.tv_sec = (deadline - wait_margin_ns) / 1000000000ull;
+            ts.tv_nsec = (deadline - wait_margin_ns) % 1000000000ull;
+            pthread_cond_timedwait(&pulse_cond, &pulse_mutex, &ts);
+            continue; // check the deadlines again
+        }
+
+        // end of the wait without the mutex, so that startPulse is not blocked by the spin. A new pulse
+        // stops the spin (pulse_rearm), its deadline may be earlier than the one of the spin
+        pthread_mutex_unlock(&pulse_mutex);
+        if (waitUntil(deadline, &pulse_rearm) < 0)
+        {
+            pthread_mutex_lock(&pulse_mutex);
+            continue;
+        }
+        pthread_mutex_lock(&pulse_mutex);
+
+        // the deadlines replaced by a new pulse in the meantime are not reached yet
+        resetPulseBits(deadline + PULSE_COALESCE_NS);
+    }
+    pthread_mutex_unlock(&pulse_mutex);
+
+    return NULL;
+}
+
+void startPulseThread(void)
+{
+    pthread_condattr_t attr;
+
+    if (pulse_thread_running)
+        return;
+
+    // the deadlines are expressed with the monotonic clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pulse_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pulse_quit = 0;
+    if (startWorker(&pulse_thread, pulseLoop) != 0)
+        mexErrMsgTxt("Couldn't start the pulse thread \n");
+    pulse_thread_running = 1;
+}
+
+/**
+ * Stop the pulse thread (before closing the ports)
+ *
+ * The pulses still pending are reset immediately so that the trigger lines are never left high.
+ * */
+void stopPulseThread(void)
+{
+    if (!pulse_thread_running)
+        return;
+
+    pthread_mutex_lock(&pulse_mutex);
+    resetPulseBits(UINT64_MAX);
+    pulse_quit = 1;
+    pthread_cond_signal(&pulse_cond);
+    pthread_mutex_unlock(&pulse_mutex);
+
+    pthread_join(pulse_thread, NULL);
+    pthread_cond_destroy(&pulse_cond);
+    pulse_thread_running = 0;
+}
+
+/**
+ * Write the message on the bits of the mask, they go back to 0 after width_ns (any thread)
+ *
+ * The pulse thread must be running. Returns 0 or an errno (see writePort).
+ * */
+int startPulse(unsigned char message, unsigned char mask, uint64_t width_ns)
+{
+    int err;
+
+    pthread_mutex_lock(&pulse_mutex);
+    pthread_mutex_lock(&data_mutex);
+    pulse_port_idx = writing_port_idx;
+    err = modifyDataLocked(~mask, message & mask, writing_port_idx, NULL);
+    if (err == 0)
+    {
+        pulse_high_ns = monotonicNs();
+        pulse_low_ns = 0;
+        pulse_mask = mask;
+        for (int b = 0; b < 8; b++)
+            if (mask & (1 << b))
+                pulse_deadlines[b] = pulse_high_ns + width_ns;
+        atomic_store_explicit(&pulse_rearm, 1, memory_order_relaxed);
+        pthread_cond_signal(&pulse_cond);
+    }
+    pthread_mutex_unlock(&data_mutex);
+    pthread_mutex_unlock(&pulse_mutex);
+    return err;
+}
+
+/**
+ * Fire the armed rules matching a change of the STATUS of a port (event thread)
+ *
+ * t_read_ns is the time of the read that saw the change, the latency of the rule ends with its write.
+ * */
+void applyRules(int idx, unsigned char old_status, unsigned char new_status, uint64_t t_read_ns)
+{
+    if (atomic_load_explicit(&rule_count, memory_order_relaxed) == 0)
+        return;
+    pthread_mutex_lock(&rule_mutex);
+    for (int k = 0; k < atomic_load_explicit(&rule_count, memory_order_relaxed); k++)
+    {
+        Rule *rule = &rules[k];
+        unsigned char edges = rule->falling ? old_status & ~new_status : new_status & ~old_status;
+        int armed = 1;
+        uint64_t latency;
+
+        if (rule->port != idx || !(edges & rule->mask) || !atomic_load_explicit(&rule->armed, memory_order_relaxed))
+            continue;
+        if (!rule->repeat && !atomic_compare_exchange_strong(&rule->armed, &armed, 0))
+            continue;
+        if ((rule->width_ns > 0 ? startPulse(rule->code, 0xFF, rule->width_ns)
+                                : modifyData(0, rule->code, writing_port_idx, NULL)) != 0)
+            continue;
+        latency = monotonicNs() - t_read_ns;
+        histogramRecord(&hist_rule_latency, latency);
+        atomic_store_explicit(&rule->latency_ns, latency, memory_order_relaxed);
+        atomic_fetch_add_explicit(&rule->fired, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&rule_mutex);
+}
+
+/**
+ * Add an event to the ring (event thread only)
+ *
+ * The event is dropped (and counted) if Matlab did not drain the ring in time.
+ * */
+void pushEvent(const PortEvent *event)
+{
+    uint_fast64_t head = atomic_load_explicit(&event_head, memory_order_relaxed);
+    size_t slot;
+
+    publishShared(PPMEG_SHM_RESPONSE, event->port, event->old_status, event->new_status, event->t_ns);
+    if (head - atomic_load_explicit(&event_tail, memory_order_acquire) >= EVENT_RING_SIZE)
+    {
+        atomic_fetch_add_explicit(&event_dropped, 1, memory_order_relaxed);
+        return;
+    }
+    slot = head & (EVENT_RING_SIZE - 1);
+    event_t_ns[slot] = event->t_ns;
+    event_port[slot] = event->port + 1;
+    event_old[slot] = event->old_status;
+    event_new[slot] = event->new_status;
+    atomic_store_explicit(&event_head, head + 1, memory_order_release);
+}
+
+/**
+ * Body of the event thread
+ *
+ * Reads the STATUS pins of every opened port in a loop and only keeps the changes.
+ * With a period, the reads are paced on absolute deadlines (waitUntil), otherwise the thread spins.
+ * */
+void *eventPollLoop(void *arg)
+{
+    unsigned char last[PARPORT_MAX] = {0};
+    PortEvent event;
+    uint64_t next = monotonicNs(), t_poll, t_last_poll = 0;
+
+    (void)arg;
+    prepareWorkerThread();
+    memcpy(last, event_start_status, sizeof(last));
+
+    while (!atomic_load_explicit(&event_quit, memory_order_relaxed))
+    {
+        t_poll = monotonicNs();
+        if (t_last_poll > 0)
+            histogramRecord(&hist_event_interval, t_poll - t_last_poll);
+        t_last_poll = t_poll;
+        for (int i = 0; i < port_count; i++)
+        {
+            if (!(pports[i].role & PORT_IN) || readButtons(&event.new_status, i) != 0 || event.new_status == last[i])
+                continue;
+            event.t_ns = monotonicNs();
+            event.port = i;
+            event.old_status = last[i];
+            last[i] = event.new_status;
+            applyRules(i, event.old_status, event.new_status, event.t_ns);
+            pushEvent(&event);
+        }
+
+        if (event_period_ns > 0)
+        {
+            next += event_period_ns;
+            waitUntil(next, &event_quit);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Body of the event thread in interrupt mode
+ *
+ * Sleeps in poll() on all the ports (the nACK interrupt makes the ppdev fd readable) and on a pipe used to
+ * stop the thread. Each wake up is timestamped, the interrupt count is cleared (PPCLRIRQ) and the STATUS pins
+ * are read: an event is pushed even if the status did not change, the pulse may be shorter than the wake up.
+ * */
+void *eventIrqLoop(void *arg)
+{
+    struct pollfd fds[PARPORT_MAX + 1];
+    unsigned char last[PARPORT_MAX] = {0};
+    PortEvent event;
+    uint64_t t, t_last = 0;
+    int irq_count;
+
+    (void)arg;
+    prepareWorkerThread();
+    memcpy(last, event_start_status, sizeof(last));
+    for (int i = 0; i < port_count; i++)
+    {
+        // negative fds are ignored by poll()
+        fds[i].fd = pports[i].backend != NULL && (pports[i].role & PORT_IN) ? pports[i].fd : -1;
+        fds[i].events = POLLIN;
+    }
+    fds[port_count].fd = event_wake_pipe[0];
+    fds[port_count].events = POLLIN;
+
+    while (!atomic_load_explicit(&event_quit, memory_order_relaxed))
+    {
+        if (poll(fds, port_count + 1, -1) <= 0)
+            continue;
+        t = monotonicNs();
+        if (t_last > 0)
+            histogramRecord(&hist_event_interval, t - t_last);
+        t_last = t;
+
+        for (int i = 0; i < port_count; i++)
+        {
+            if (!(fds[i].revents & POLLIN))
+                continue;
+            ioctl(pports[i].fd, PPCLRIRQ, &irq_count);
+            if (readButtons(&event.new_status, i) != 0)
+                continue;
+            event.t_ns = t;
+            event.port = i;
+            event.old_status = last[i];
+            last[i] = event.new_status;
+            applyRules(i, event.old_status, event.new_status, t);
+            pushEvent(&event);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Prepare the ports for the interrupt mode
+ *
+ * ppdev registers an interrupt handler when the port is claimed and parport_pc then sets the IRQ enable bit of
+ * the CONTROL register by itself, but only if the kernel assigned an IRQ to the port (see the irq= option of
+ * parport_pc). The IRQ is checked in /proc/sys/dev/parport/parport<N>/irq and the pending counts are cleared.
+ * */
+void preparePortInterrupts(void)
+{
+    char address[256];
+    char path[300];
+    ssize_t len;
+    FILE *f;
+    int irq, irq_count;
+
+    for (int i = 0; i < port_count; i++)
+    {
+        if (pports[i].backend == NULL || !(pports[i].role & PORT_IN))
+            continue;
+        if (pports[i].fd < 0)
+            mexErrMsgTxt("The interrupt mode requires the ppdev or ioport backend \n");
+
+        // name of the device behind the descriptor, e.g. /dev/parport1 -> parport1
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", pports[i].fd);
+        f = NULL;
+        len = readlink(path, address, sizeof(address) - 1);
+        if (len > 0)
+        {
+            address[len] = '\0';
+            snprintf(path, sizeof(path), "/proc/sys/dev/parport/%s/irq", strrchr(address, '/') + 1);
+            f = fopen(path, "r");
+        }
+        if (f != NULL)
+        {
+            if (fscanf(f, "%d", &irq) == 1 && irq < 0)
+            {
+                fclose(f);
+                mexPrintf("%s has no IRQ assigned (%s)\n", address, path);
+                mexErrMsgTxt("No IRQ on the parallel port, use the polling mode \n");
+            }
+            fclose(f);
+        }
+        ioctl(pports[i].fd, PPCLRIRQ, &irq_count); // forget the interrupts received before
+    }
+}
+
+void closeEventWakePipe(void)
+{
+    for (int k = 0; k < 2; k++)
+    {
+        if (event_wake_pipe[k] >= 0)
+            close(event_wake_pipe[k]);
+        event_wake_pipe[k] = -1;
+    }
+}
+
+void startEventThread(uint64_t period_ns, int use_irq)
+{
+    if (event_thread_running)
+        mexErrMsgTxt("The event thread is already running");
+
+    // events of a previous acquisition are discarded
+    atomic_store(&event_tail, atomic_load(&event_head));
+    atomic_store(&event_dropped, 0);
+    atomic_store(&event_quit, 0);
+    event_period_ns = period_ns;
+    event_use_irq = use_irq;
+
+    if (use_irq)
+    {
+        preparePortInterrupts();
+        if (pipe(event_wake_pipe) < 0)
+            mexErrMsgTxt("Couldn't create the pipe of the event thread \n");
+    }
+
+    // the starting values are read before 'start' returns, so that a change made right after it is reported
+    memset(event_start_status, 0, sizeof(event_start_status));
+    for (int i = 0; i < port_count; i++)
+        if (pports[i].role & PORT_IN)
+            readButtons(&event_start_status[i], i);
+
+    if (startWorker(&event_thread, use_irq ? eventIrqLoop : eventPollLoop) != 0)
+    {
+        closeEventWakePipe();
+        mexErrMsgTxt("Couldn't start the event thread \n");
+    }
+    event_thread_running = 1;
+}
+
+void stopEventThread(void)
+{
+    const char wake = 1;
+
+    if (!event_thread_running)
+        return;
+
+    atomic_store(&event_quit, 1);
+    if (event_use_irq && write(event_wake_pipe[1], &wake, 1) < 0)
+        mexPrintf("Couldn't wake up the event thread : %s (%d)\n", strerror(errno), errno);
+    pthread_join(event_thread, NULL);
+    event_thread_running = 0;
+
+    if (event_use_irq)
+        closeEventWakePipe();
+}
+
+/**
+ * Body of the schedule thread
+ *
+ * Each message is written at its absolute time with waitUntil (clock_nanosleep(TIMER_ABSTIME), then spin).
+ * The lateness is the time at the end of the write minus the deadline.
+ * */
+void *scheduleLoop(void *arg)
+{
+    (void)arg;
+    prepareWorkerThread();
+    for (size_t k = 0; k < schedule_n; k++)
+    {
+        if (waitUntil(schedule_t_ns[k], &schedule_quit) < 0)
+            break;
+        modifyData(0, schedule_values[k], writing_port_idx, NULL);
+        schedule_lateness_ns[k] = (int64_t)(monotonicNs() - schedule_t_ns[k]);
+        histogramRecord(&hist_schedule, schedule_lateness_ns[k] > 0 ? schedule_lateness_ns[k] : 0);
+        atomic_store_explicit(&schedule_played, k + 1, memory_order_release);
+    }
+
+    return NULL;
+}
+
+void stopScheduleThread(void)
+{
+    if (!schedule_thread_running)
+        return;
+
+    atomic_store(&schedule_quit, 1);
+    pthread_join(schedule_thread, NULL);
+    schedule_thread_running = 0;
+}
+
+void freeSchedule(void)
+{
+    stopScheduleThread();
+    free(schedule_t_ns);
+    free(schedule_values);
+    free(schedule_lateness_ns);
+    schedule_t_ns = NULL;
+    schedule_values = NULL;
+    schedule_lateness_ns = NULL;
+    schedule_n = 0;
+    atomic_store(&schedule_played, 0);
+}
+
+/**
+ * Copy the sequence (times in s, CLOCK_MONOTONIC) and start playing it
+ *
+ * A sequence still playing is cancelled.
+ * */
+void startSchedule(const double *times, const double *values, size_t n)
+{
+    freeSchedule();
+    if (writing_port_idx < 0 || pports[writing_port_idx].backend == NULL)
+        mexErrMsgTxt("Parallel port was not opened \n");
+    if (n == 0)
+        return;
+
+    schedule_t_ns = malloc(n * sizeof(uint64_t));
+    schedule_values = malloc(n);
+    schedule_lateness_ns = malloc(n * sizeof(int64_t));
+    if (schedule_t_ns == NULL || schedule_values == NULL || schedule_lateness_ns == NULL)
+    {
+        freeSchedule();
+        mexErrMsgTxt("Couldn't allocate the sequence \n");
+    }
+    for (size_t k = 0; k < n; k++)
+    {
+        schedule_t_ns[k] = times[k] > 0 ? (uint64_t)(times[k] * 1e9) : 0;
+        schedule_values[k] = (unsigned char)values[k];
+        if (k > 0 && schedule_t_ns[k] < schedule_t_ns[k - 1])
+        {
+            freeSchedule();
+            mexErrMsgTxt("The times of the sequence must be increasing");
+        }
+    }
+    schedule_n = n;
+
+    atomic_store(&schedule_quit, 0);
+    if (rt_lock == 1)
+        lockBuffers(1);
+    if (startWorker(&schedule_thread, scheduleLoop) != 0)
+    {
+        freeSchedule();
+        mexErrMsgTxt("Couldn't start the schedule thread \n");
+    }
+    schedule_thread_running = 1;
+}
+
+/**
+ * Set the bits of the pulse train to bits on its port, the other bits keep the shadow (train thread)
+ * */
+int writeTrain(unsigned char bits)
+{
+    unsigned char data;
+    int err;
+
+    pthread_mutex_lock(&data_mutex);
+    data = (atomic_load_explicit(&pports[train_port_idx].data, memory_order_relaxed) & ~train_mask) | bits;
+    err = writePort(&data, train_port_idx, 0);
+    pthread_mutex_unlock(&data_mutex);
+    return err;
+}
+
+/**
+ * Body of the train thread
+ *
+ * The rising edge k is due at train_start_ns + k * train_period_ns and the falling edge train_width_ns later, so
+ * a late wake-up delays one edge but not the following ones. A rising edge already too late for its pulse to end
+ * before the next one (a stall of the computer) is skipped. The bits are left low when the thread ends.
+ * */
+void *trainLoop(void *arg)
+{
+    int high = 0;
+
+    (void)arg;
+    prepareWorkerThread();
+    for (uint64_t k = 0; train_count == 0 || k < train_count; k++)
+    {
+        uint64_t rise = train_start_ns + k * train_period_ns, t;
+        int64_t lateness = waitUntil(rise, &train_quit);
+
+        if (lateness < 0)
+            break;
+        if ((uint64_t)lateness > train_period_ns - train_width_ns)
+        {
+            pthread_mutex_lock(&train_mutex);
+            train_skipped++;
+            train_last_rise_ns = 0; // the next interval spans the skipped edge, it is not an achieved period
+            pthread_mutex_unlock(&train_mutex);
+            continue;
+        }
+        if (writeTrain(train_mask) != 0)
+            break;
+        high = 1;
+        t = monotonicNs();
+        histogramRecord(&hist_train_lateness, t - rise);
+
+        pthread_mutex_lock(&train_mutex);
+        if (train_last_rise_ns != 0)
+        {
+            uint64_t period = t - train_last_rise_ns;
+
+            if (train_periods++ == 0 || period < train_period_min_ns)
+                train_period_min_ns = period;
+            if (period > train_period_max_ns)
+                train_period_max_ns = period;
+            train_error_sum += (double)period - train_period_ns;
+            train_error_sum2 += ((double)period - train_period_ns) * ((double)period - train_period_ns);
+        }
+        train_last_rise_ns = t;
+        train_pulses++;
+        pthread_mutex_unlock(&train_mutex);
+
+        if (waitUntil(rise + train_width_ns, &train_quit) < 0 || writeTrain(0) != 0)
+            break;
+        high = 0;
+    }
+    if (high)
+        writeTrain(0);
+    atomic_store(&train_reserved, 0);
+
+    return NULL;
+}
+
+void stopTrainThread(void)
+{
+    if (!train_thread_running)
+        return;
+
+    atomic_store(&train_quit, 1);
+    pthread_join(train_thread, NULL);
+    train_thread_running = 0;
+}
+
+/**
+ * Start a train of count pulses (0 = until stopped) on the bits of mask of the writing port, TRAIN_LEAD_NS from now
+ *
+ * A train still running is stopped first.
+ * */
+void startTrainThread(unsigned char mask, uint64_t period_ns, uint64_t width_ns, uint64_t count)
+{
+    stopTrainThread();
+    if (writing_port_idx < 0 || pports[writing_port_idx].backend == NULL)
+        mexErrMsgTxt("Parallel port was not opened \n");
+
+    train_port_idx = writing_port_idx;
+    train_mask = mask;
+    train_period_ns = period_ns;
+    train_width_ns = width_ns;
+    train_count = count;
+    train_pulses = 0;
+    train_skipped = 0;
+    train_periods = 0;
+    train_last_rise_ns = 0;
+    train_period_min_ns = 0;
+    train_period_max_ns = 0;
+    train_error_sum = 0;
+    train_error_sum2 = 0;
+    atomic_store(&train_quit, 0);
+    // reserved before the first write, so that no other writer changes the bits during the train
+    atomic_store(&train_reserved, mask);
+    train_start_ns = monotonicNs() + TRAIN_LEAD_NS;
+    if (startWorker(&train_thread, trainLoop) != 0)
+    {
+        atomic_store(&train_reserved, 0);
+        mexErrMsgTxt("Couldn't start the train thread \n");
+    }
+    train_thread_running = 1;
+}
+
+/**
+ * Body of the queue thread
+ *
+ * Writes the queued values in order. Each value stays on the port for at least queue_hold_ns (from the end of its
+ * write to the start of the next one, precision wait), the thread sleeps when the queue is empty.
+ * */
+void *queueLoop(void *arg)
+{
+    uint64_t next = 0, t;
+    uint_fast64_t tail = atomic_load(&queue_tail);
+    QueuedWrite item;
+
+    (void)arg;
+    prepareWorkerThread();
+    for (;;)
+    {
+        pthread_mutex_lock(&queue_mutex);
+        while (!queue_quit && !atomic_load(&queue_abort) &&
+               tail == atomic_load_explicit(&queue_head, memory_order_acquire))
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+        if (atomic_load(&queue_abort) || tail == atomic_load_explicit(&queue_head, memory_order_acquire))
+        {
+            pthread_mutex_unlock(&queue_mutex);
+            break;
+        }
+        pthread_mutex_unlock(&queue_mutex);
+
+        item = write_queue[tail & (WRITE_QUEUE_SIZE - 1)];
+        atomic_store_explicit(&queue_tail, ++tail, memory_order_release);
+
+        if (waitUntil(next, &queue_abort) < 0)
+            break;
+        modifyData(0, item.value, writing_port_idx, NULL);
+        t = monotonicNs();
+        histogramRecord(&hist_queue_delay, t - item.t_ns);
+        next = t + atomic_load_explicit(&queue_hold_ns, memory_order_relaxed);
+    }
+
+    return NULL;
+}
+
+/**
+ * Push a value for the queue thread (Matlab thread only)
+ *
+ * Returns 0, EBADF if the trigger port is not opened or ENOBUFS if the queue is full.
+ * */
+int queueWrite(unsigned char value)
+{
+    uint_fast64_t head = atomic_load_explicit(&queue_head, memory_order_relaxed);
+    uint_fast64_t depth = head - atomic_load_explicit(&queue_tail, memory_order_acquire);
+    QueuedWrite *item = &write_queue[head & (WRITE_QUEUE_SIZE - 1)];
+
+    if (writing_port_idx < 0 || pports[writing_port_idx].backend == NULL)
+        return EBADF;
+    if (depth >= WRITE_QUEUE_SIZE)
+    {
+        queue_full++;
+        return ENOBUFS;
+    }
+    item->t_ns = monotonicNs();
+    item->value = value;
+    if (depth + 1 > queue_max_depth)
+        queue_max_depth = depth + 1;
+
+    // the mutex orders the push with the check of the sleeping thread, so that no wake up is lost
+    pthread_mutex_lock(&queue_mutex);
+    atomic_store_explicit(&queue_head, head + 1, memory_order_release);
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+    return 0;
+}
+
+/**
+ * Write a trigger from 'w': through the queue when it runs, directly otherwise
+ * */
+int writeTrigger(unsigned char value)
+{
+    if (queue_thread_running)
+        return queueWrite(value);
+    return modifyData(0, value, writing_port_idx, NULL);
+}
+
+void startQueueThread(uint64_t hold_ns)
+{
+    pthread_condattr_t attr;
+
+    atomic_store(&queue_hold_ns, hold_ns);
+    if (queue_thread_running)
+        return;
+    if (writing_port_idx < 0 || pports[writing_port_idx].backend == NULL)
+        mexErrMsgTxt("Parallel port was not opened \n");
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    atomic_store(&queue_tail, atomic_load(&queue_head));
+    queue_max_depth = 0;
+    queue_full = 0;
+    queue_quit = 0;
+    atomic_store(&queue_abort, 0);
+    if (startWorker(&queue_thread, queueLoop) != 0)
+        mexErrMsgTxt("Couldn't start the queue thread \n");
+    queue_thread_running = 1;
+}
+
+/**
+ * Stop the queue thread, after writing the pending values if flush (they are lost otherwise)
+ * */
+void stopQueueThread(int flush)
+{
+    if (!queue_thread_running)
+        return;
+
+    pthread_mutex_lock(&queue_mutex);
+    queue_quit = 1;
+    if (!flush)
+        atomic_store(&queue_abort, 1);
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+
+    pthread_join(queue_thread, NULL);
+    pthread_cond_destroy(&queue_cond);
+    queue_thread_running = 0;
+}
+
+/**
+ * Map the chunk of the record file holding the record number n (it is the first record of the chunk)
+ *
+ * Returns 0 or an errno.
+ * */
+int mapRecordChunk(uint64_t n)
+{
+    size_t chunk_size = RECORD_CHUNK_RECORDS * sizeof(RecordEntry);
+    off_t offset = RECORD_HEADER_SIZE + (off_t)(n / RECORD_CHUNK_RECORDS) * chunk_size;
+    void *chunk;
+
+    if (record_chunk != NULL)
+        munmap(record_chunk, chunk_size);
+    record_chunk = NULL;
+    if (ftruncate(record_fd, offset + chunk_size) < 0)
+        return errno;
+    chunk = mmap(NULL, chunk_size, PROT_READ | PROT_WRITE, MAP_SHARED, record_fd, offset);
+    if (chunk == MAP_FAILED)
+        return errno;
+    record_chunk = chunk;
+    return 0;
+}
+
+/**
+ * Append a record to the file (record thread)
+ *
+ * Returns 0 or an errno.
+ * */
+int appendRecord(uint64_t t_ns, uint32_t run, int port, int reg, unsigned char value)
+{
+    RecordEntry *entry;
+    int err;
+
+    if (record_n > 0 && record_n % RECORD_CHUNK_RECORDS == 0 && (err = mapRecordChunk(record_n)) != 0)
+        return err;
+    entry = &record_chunk[record_n % RECORD_CHUNK_RECORDS];
+    entry->t_ns = t_ns;
+    entry->run = run;
+    entry->port = port + 1;
+    entry->reg = reg;
+    entry->value = value;
+    entry->reserved = 0;
+    atomic_store_explicit(&record_header->n_records, ++record_n, memory_order_release);
+    return 0;
+}
+
+/**
+ * Body of the record thread
+ *
+ * Reads the STATUS of the response ports and the shadow of the DATA of the trigger port in a loop (paced on
+ * absolute deadlines with a period) and appends the changes, with the length of the previous run. The runs
+ * saturate: when one reaches UINT32_MAX samples (about an hour of continuous polling), a record of the same value
+ * is appended with this run and the count starts again, ppMEG_readrecord adds the pieces up.
+ * */
+void *recordLoop(void *arg)
+{
+    unsigned char last[PARPORT_MAX][2], value;
+    uint32_t run[PARPORT_MAX][2] = {{0}};
+    uint64_t next = monotonicNs(), t = next, t_last = 0;
+    int err = 0;
+
+    (void)arg;
+    prepareWorkerThread();
+
+    // initial state of every pin set
+    for (int i = 0; i < port_count && err == 0; i++)
+    {
+        if ((pports[i].role & PORT_IN) && readPort(&last[i][0], i) == 0)
+            err = appendRecord(t, 0, i, 0, last[i][0]);
+        last[i][1] = atomic_load(&pports[i].data);
+        if ((pports[i].role & PORT_OUT) && err == 0)
+            err = appendRecord(t, 0, i, 1, last[i][1]);
+    }
+
+    while (err == 0 && !atomic_load_explicit(&record_quit, memory_order_relaxed))
+    {
+        t = monotonicNs();
+        if (t_last > 0)
+            histogramRecord(&hist_record_interval, t - t_last);
+        t_last = t;
+        for (int i = 0; i < port_count && err == 0; i++)
+        {
+            if ((pports[i].role & PORT_IN) && readPort(&value, i) == 0)
+            {
+                if (value != last[i][0])
+                {
+                    err = appendRecord(t, run[i][0], i, 0, value);
+                    last[i][0] = value;
+                    run[i][0] = 0;
+                }
+                if (++run[i][0] == UINT32_MAX && err == 0)
+                {
+                    err = appendRecord(t, run[i][0], i, 0, value);
+                    run[i][0] = 0;
+                }
+            }
+            if (pports[i].role & PORT_OUT)
+            {
+                value = atomic_load_explicit(&pports[i].data, memory_order_relaxed);
+                if (value != last[i][1] && err == 0)
+                {
+                    err = appendRecord(t, run[i][1], i, 1, value);
+                    last[i][1] = value;
+                    run[i][1] = 0;
+                }
+                if (++run[i][1] == UINT32_MAX && err == 0)
+                {
+                    err = appendRecord(t, run[i][1], i, 1, value);
+                    run[i][1] = 0;
+                }
+            }
+        }
+
+        if (record_period_ns > 0)
+        {
+            next += record_period_ns;
+            waitUntil(next, &record_quit);
+        }
+    }
+    record_error = err;
+
+    return NULL;
+}
+
+/**
+ * Close the record file: its size is cut to the records written
+ * */
+void closeRecordFile(void)
+{
+    if (record_chunk != NULL)
+        munmap(record_chunk, RECORD_CHUNK_RECORDS * sizeof(RecordEntry));
+    record_chunk = NULL;
+    if (record_header != NULL)
+    {
+        if (ftruncate(record_fd, RECORD_HEADER_SIZE + record_n * sizeof(RecordEntry)) < 0 && record_error == 0)
+            record_error = errno;
+        munmap(record_header, RECORD_HEADER_SIZE);
+    }
+    record_header = NULL;
+    if (record_fd >= 0)
+        close(record_fd);
+    record_fd = -1;
+}
+
+void startRecordThread(const char *path, uint64_t period_ns)
+{
+    int flags = O_TRUNC, err;
+
+    if (record_thread_running)
+        mexErrMsgTxt("The record thread is already running");
+    if (port_count == 0)
+        mexErrMsgTxt("Parallel port was not opened \n");
+
+    // the file is created (an existing file is replaced), then its header is mapped and filled
+    record_n = 0;
+    record_error = 0;
+#ifdef PPMEG_DAEMON
+    // the daemon does not open the paths of its clients: a new file (no link followed) in the directory of the socket
+    if (strchr(path, '/') != NULL || strcmp(path, ".") == 0 || strcmp(path, "..") == 0 ||
+        snprintf(record_path, sizeof(record_path), "%s/%s", daemon_dir, path) >= (int)sizeof(record_path))
+        mexErrMsgTxt("In the daemon, the record file is a new file of the directory of the socket: a name, no '/'");
+    flags = O_EXCL | O_NOFOLLOW;
+#else
+    snprintf(record_path, sizeof(record_path), "%s", path);
+#endif
+    record_fd = open(record_path, O_RDWR | O_CREAT | flags, 0644);
+    if (record_fd < 0 || ftruncate(record_fd, RECORD_HEADER_SIZE) < 0)
+    {
+        err = errno;
+        closeRecordFile();
+        mexPrintf("Record file %s : %s (%d)\n", record_path, strerror(err), err);
+        mexErrMsgTxt("Couldn't create the record file \n");
+    }
+    record_header = mmap(NULL, RECORD_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, record_fd, 0);
+    if (record_header == MAP_FAILED)
+        record_header = NULL;
+    if (record_header == NULL || (err = mapRecordChunk(0)) != 0)
+    {
+        err = record_header == NULL ? errno : err;
+        closeRecordFile();
+        mexPrintf("Record file %s : %s (%d)\n", record_path, strerror(err), err);
+        mexErrMsgTxt("Couldn't map the record file \n");
+    }
+    memcpy(record_header->magic, RECORD_MAGIC, sizeof(record_header->magic));
+    record_header->version = RECORD_VERSION;
+    record_header->record_size = sizeof(RecordEntry);
+    record_header->t_start_ns = monotonicNs();
+    atomic_store(&record_header->n_records, 0);
+    record_header->n_ports = port_count;
+    record_header->writing_port = writing_port_idx + 1;
+
+    record_period_ns = period_ns;
+    atomic_store(&record_quit, 0);
+    if (startWorker(&record_thread, recordLoop) != 0)
+    {
+        closeRecordFile();
+        mexErrMsgTxt("Couldn't start the record thread \n");
+    }
+    record_thread_running = 1;
+}
+
+void stopRecordThread(void)
+{
+    if (!record_thread_running)
+        return;
+
+    atomic_store(&record_quit, 1);
+    pthread_join(record_thread, NULL);
+    record_thread_running = 0;
+    closeRecordFile();
+}
+
+/**
+ * Create (or replace, except in the daemon) the shared-memory object name and start publishing in it
+ * */
+void startShare(const char *name)
+{
+    size_t size = PPMEG_SHM_HEADER_SIZE + PPMEG_SHM_CAPACITY * sizeof(PPMEGShmRecord);
+    PPMEGShmHeader *header;
+    int flags = O_TRUNC, fd, err;
+
+    if (atomic_load(&shm_header) != NULL)
+        mexErrMsgTxt("The shared-memory ring is already published");
+    if (port_count == 0)
+        mexErrMsgTxt("Parallel port was not opened \n");
+    if (name[0] != '/' || strlen(name) >= sizeof(shm_name) || strchr(name + 1, '/') != NULL)
+        mexErrMsgTxt("The name of the shared memory must be '/name' (no other '/')");
+
+#ifdef PPMEG_DAEMON
+    flags = O_EXCL; // the daemon does not replace an object of another process
+#endif
+    fd = shm_open(name, O_RDWR | O_CREAT | flags, 0644);
+    if (fd < 0 || ftruncate(fd, size) < 0)
+    {
+        err = errno;
+        if (fd >= 0)
+            close(fd);
+        mexPrintf("Shared memory %s : %s (%d)\n", name, strerror(err), err);
+        mexErrMsgTxt("Couldn't create the shared memory \n");
+    }
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    err = errno;
+    close(fd);
+    if (header == MAP_FAILED)
+    {
+        shm_unlink(name);
+        mexPrintf("Shared memory %s : %s (%d)\n", name, strerror(err), err);
+        mexErrMsgTxt("Couldn't map the shared memory \n");
+    }
+
+    // the new object is zero-filled: every seq is 0, no record is complete
+    header->version = PPMEG_SHM_VERSION;
+    header->record_size = sizeof(PPMEGShmRecord);
+    header->capacity = PPMEG_SHM_CAPACITY;
+    header->n_ports = port_count;
+    header->writing_port = writing_port_idx + 1;
+    header->t_start_ns = monotonicNs();
+    atomic_store(&header->head, 0);
+    atomic_thread_fence(memory_order_release);
+    memcpy(header->magic, PPMEG_SHM_MAGIC, sizeof(header->magic));
+    snprintf(shm_name, sizeof(shm_name), "%s", name);
+    atomic_store(&shm_header, header);
+}
+
+/**
+ * Stop publishing, remove the name of the shared memory (the readers keep their mapping)
+ * */
+void stopShare(void)
+{
+    PPMEGShmHeader *header = atomic_exchange(&shm_header, NULL);
+
+    if (header == NULL)
+        return;
+    while (atomic_load(&shm_users) != 0)
+        ;
+    munmap(header, PPMEG_SHM_HEADER_SIZE + PPMEG_SHM_CAPACITY * sizeof(PPMEGShmRecord));
+    shm_unlink(shm_name);
+}
+
+/**
+ * Block until one of the masked STATUS bits changes on a port, or until the timeout
+ *
+ * The response ports are read in a loop (spin), or every period_ns with the precision wait if period_ns > 0.
+ * Returns the index of the port (-1 on timeout), sets the new status and the time of the read that saw it.
+ * */
+int waitResponse(unsigned char mask, uint64_t timeout_ns, uint64_t period_ns, unsigned char *status, uint64_t *t_ns)
+{
+    unsigned char baseline[PARPORT_MAX] = {0};
+    uint64_t deadline, next;
+
+    for (int i = 0; i < port_count; i++)
+        if (pports[i].role & PORT_IN)
+            readButtons(&baseline[i], i);
+
+    next = monotonicNs();
+    deadline = next + timeout_ns;
+    for (;;)
+    {
+        for (int i = 0; i < port_count; i++)
+        {
+            if (!(pports[i].role & PORT_IN) || readButtons(status, i) != 0 || ((*status ^ baseline[i]) & mask) == 0)
+                continue;
+            *t_ns = monotonicNs();
+            return i;
+        }
+        if (monotonicNs() >= deadline)
+            return -1;
+        if (period_ns > 0)
+        {
+            next += period_ns;
+            waitUntil(next < deadline ? next : deadline, NULL);
+        }
+    }
+}
+
+/**
+ * Stop every background thread, they must not use the ports while they are closed/reopened
+ * */
+void stopThreads(void)
+{
+    stopTrainThread();
+    stopQueueThread(0);
+    stopRecordThread();
+    stopScheduleThread();
+    stopEventThread();
+    stopPulseThread();
+}
+
+/**
+ * Clean the port up (on exit or to avoid repeted openings)
+ *
+ * Raise an error if the port was not successfully closed.
+ * Do nothing if the port was not opened.
+ * */
+void unloadPort(ParPort *port)
+{
+    const PortBackend *backend = port->backend;
+
+    if (backend != NULL)
+    {
+        port->backend = NULL;
+        if (backend->release(port) != 0)
+            mexErrMsgTxt("Release Error\n");
+        mexPrintf("Parallel port has been closed \n");
+    }
+}
+
+void unloadAll(void)
+{
+    stopThreads();
+    stopShare();
+    freeSchedule();
+    atomic_store(&rule_count, 0); // they refer to the port table
+    for (int i = 0; i < PARPORT_MAX; i++)
+        unloadPort(&pports[i]);
+    port_count = 0;
+    writing_port_idx = -1;
+}
+
+/**
+ * Set an entry of the port table (the port must be closed)
+ *
+ * The histograms of the port are cleared and its decode table is the identity, it may now be another device.
+ * */
+void configurePort(int idx, const char *address, int role)
+{
+    if (strlen(address) >= sizeof(pports[idx].address))
+        mexErrMsgTxt("The port address is too long");
+    strcpy(pports[idx].address, address);
+    pports[idx].role = role;
+    setDecodeTable(&pports[idx], NULL, 0, 0);
+    histogramReset(&pports[idx].write_hist);
+    histogramReset(&pports[idx].read_hist);
+}
+
+/**
+ * Set the roles of the first n ports of the table from a string, one letter per port:
+ * 'i' response input, 'o' trigger output, 'b' both
+ * */
+void setPortRoles(const mxArray *roles, int n)
+{
+    char letters[PARPORT_MAX + 1];
+
+    if (!mxIsChar(roles) || mxGetNumberOfElements(roles) != n || mxGetString(roles, letters, sizeof(letters)) != 0)
+        mexErrMsgTxt("The roles must be a string with one letter per port : 'i' (input), 'o' (output), 'b' (both)");
+    for (int i = 0; i < n; i++)
+    {
+        if (letters[i] == 'i')
+            pports[i].role = PORT_IN;
+        else if (letters[i] == 'o')
+            pports[i].role = PORT_OUT;
+        else if (letters[i] == 'b')
+            pports[i].role = PORT_IN | PORT_OUT;
+        else
+            mexErrMsgTxt("Unknown port role : 'i' (input), 'o' (output), 'b' (both)");
+    }
+}
+
+/**
+ * Fill the port table with the /dev/parport<N> devices present, as response ports
+ *
+ * Returns the number of ports found.
+ * */
+int discoverPorts(void)
+{
+    char address[32];
+    int n = 0;
+
+    for (int k = 0; k < PARPORT_MAX; k++)
+    {
+        snprintf(address, sizeof(address), "/dev/parport%d", k);
+        if (access(address, F_OK) == 0)
+            configurePort(n++, address, PORT_IN);
+    }
+    return n;
+}
+
+/**
+ * Returns 1 if the command (Matlab char array) is exactly the given name
+ *
+ * The characters are compared in place, no string is allocated.
+ * */
+int isAction(const mxArray *command, const char *name)
+{
+    const mxChar *chars = mxGetChars(command);
+    size_t n = mxGetNumberOfElements(command);
+
+    if (strlen(name) != n)
+        return 0;
+    for (size_t k = 0; k < n; k++)
+        if (chars[k] != (mxChar)name[k])
+            return 0;
+    return 1;
+}
+
+/**
+ * Hands a buffer allocated with mxMalloc to a new m x n numeric array of the given class (no copy)
+ *
+ * The array owns the buffer afterwards. An empty buffer (NULL) gives an empty array.
+ * */
+mxArray *adoptMatrix(void *data, size_t m, size_t n, mxClassID class_id)
+{
+    mxArray *array = mxCreateNumericMatrix(0, 0, class_id, mxREAL);
+
+    if (data == NULL)
+        return array;
+    mxSetData(array, data);
+    mxSetM(array, m);
+    mxSetN(array, n);
+    return array;
+}
+
+/**
+ * Copies n elements of a ring (power of 2 size) from the position tail into a new mxMalloc buffer
+ *
+ * At most two memcpy: up to the end of the ring, then from its start. Returns NULL if n is 0.
+ * */
+void *copyRing(const void *ring, size_t elem_size, size_t ring_size, uint_fast64_t tail, size_t n)
+{
+    size_t start = tail & (ring_size - 1);
+    size_t first = n < ring_size - start ? n : ring_size - start;
+    char *data;
+
+    if (n == 0)
+        return NULL;
+    data = mxMalloc(n * elem_size);
+    memcpy(data, (const char *)ring + start * elem_size, first * elem_size);
+    memcpy(data + first * elem_size, ring, (n - first) * elem_size);
+    return data;
+}
+
+/**
+ * Close the connection to the daemon (the ports of the daemon stay open)
+ * */
+void disconnectDaemon(void)
+{
+    if (daemon_fd >= 0)
+        close(daemon_fd);
+    daemon_fd = -1;
+}
+
+/**
+ * Called when the MEX file is cleared
+ * */
+void exitMex(void)
+{
+    disconnectDaemon();
+    unloadAll();
+}
+
+void connectDaemon(const char *path)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    int err;
+
+    disconnectDaemon();
+    if (strlen(path) >= sizeof(address.sun_path))
+        mexErrMsgTxt("The path of the socket is too long");
+    strcpy(address.sun_path, path);
+    daemon_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (daemon_fd < 0 || connect(daemon_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        err = errno;
+        disconnectDaemon();
+        mexPrintf("Daemon socket %s : %s (%d)\n", path, strerror(err), err);
+        mexErrMsgTxt("Couldn't connect to the ppMEG daemon (is ppMEGd running?) \n");
+    }
+}
+
+/**
+ * Run the call in the daemon
+ *
+ * The arguments are sent, the text printed by the daemon during the call is printed here, then the outputs are
+ * returned or the error of the daemon is raised. The connection is closed if it fails.
+ * */
+void forwardCall(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    static char message[256];
+    WireReader reader;
+    int32_t status = 0, n = 0;
+    const char *text = NULL;
+    size_t length = 0;
+    int err;
+
+    wireBegin(&daemon_buffer);
+    err = wirePutInt(&daemon_buffer, nlhs);
+    if (err == 0)
+        err = wirePutInt(&daemon_buffer, nrhs);
+    for (int k = 0; k < nrhs && err == 0; k++)
+        err = wirePutArray(&daemon_buffer, prhs[k], 0);
+    if (err == EINVAL)
+        mexErrMsgTxt("Only real numeric, char, logical, cell and struct arrays can be sent to the daemon");
+    if (err == 0)
+        err = wireSend(daemon_fd, &daemon_buffer);
+    if (err == 0)
+        err = wireReceive(daemon_fd, &daemon_buffer, &reader);
+    if (err == 0 && (wireGetInt(&reader, &status) != 0 || wireGetString(&reader, &text, &length) != 0))
+        err = EPROTO;
+    if (err != 0)
+    {
+        disconnectDaemon();
+        mexPrintf("ppMEG daemon : %s (%d)\n", strerror(err), err);
+        mexErrMsgTxt("Lost the connection to the ppMEG daemon, ppMEG('connect') to connect again \n");
+    }
+    if (length > 0)
+        mexPrintf("%.*s", (int)length, text);
+
+    if (status != 0)
+    {
+        if (wireGetString(&reader, &text, &length) != 0)
+            length = 0;
+        snprintf(message, sizeof(message), "%.*s", (int)length, text);
+        mexErrMsgTxt(message);
+    }
+    if (wireGetInt(&reader, &n) != 0)
+        mexErrMsgTxt("Malformed reply of the ppMEG daemon");
+    for (int k = 0; k < n; k++)
+    {
+        mxArray *output;
+
+        // the outputs already created are freed by Matlab on error
+        if (wireGetArray(&reader, &output, 0) != 0)
+            mexErrMsgTxt("Malformed reply of the ppMEG daemon");
+        if (k < nlhs || k == 0)
+            plhs[k] = output;
+        else
+            mxDestroyArray(output);
+    }
+}
+
+/**
+ * Entry point (equivalent to the main() function in regular C)
+ *
+ * The left hand side parameters (lhs) are the output of the function directly in Matlab
+ * The right hand side parameters (rhs) are the inputs arguments from the Matlab call
+ * */
+void mexFunction(int nlhs, mxArray *plhs[],
+                 int nrhs, const mxArray *prhs[])
+{
+    static int at_exit_registered = 0;
+    const mxChar *action;
+    unsigned char message = 0;
+    double width;
+    int err;
+    char user_address[PATH_MAX]; // used only if user gives an address to the open mex function
+    char option[16];
+    const PortBackend *backend;
+    int n_args, n;
+
+    /* Make sure device is released when MEX-file is cleared */
+    if (!at_exit_registered)
+    {
+        mexAtExit(exitMex);
+        at_exit_registered = 1;
+    }
+
+    // if no input argument, display help
+    if (nrhs == 0)
+    {
+        PrintHelp();
+        return;
+    }
+
+    // ppMEG('connect'[, socket]) or ppMEG('disconnect'): while connected, every call is run by the daemon
+    if (mxIsChar(prhs[0]) && (isAction(prhs[0], "connect") || isAction(prhs[0], "disconnect")))
+    {
+#ifdef PPMEG_DAEMON
+        mexErrMsgTxt("ppMEG('connect') cannot be called in the daemon");
+#endif
+        if (isAction(prhs[0], "disconnect"))
+        {
+            disconnectDaemon();
+            return;
+        }
+        if (nrhs > 1 && (!mxIsChar(prhs[1]) || mxGetString(prhs[1], user_address, sizeof(user_address)) != 0))
+            mexErrMsgTxt("ppMEG('connect'[, socket])");
+        // the ports of this process are closed, the daemon may have to claim them
+        unloadAll();
+        if (nrhs == 1 && wireDefaultPath(user_address, sizeof(user_address)) != 0)
+            mexErrMsgTxt("The path of the socket is too long");
+        connectDaemon(user_address);
+        return;
+    }
+    if (daemon_fd >= 0)
+    {
+        forwardCall(nlhs, plhs, nrhs, prhs);
+        return;
+    }
+
+    // ppMEG(message) : shortcut for ppMEG('write', message), the trigger path does not look at any string
+    if (!mxIsChar(prhs[0]))
+    {
+        if (nrhs != 1 || mxIsEmpty(prhs[0]))
+            mexErrMsgTxt("ppMEG(message) only takes the message to send [0-255]");
+        checkPort(writeTrigger((unsigned char)mxGetScalar(prhs[0])), "PPWDATA");
+        return;
+    }
+
+    // Determine what the user is requesting
+    // Only the first letter is used to allow abbreviation (the commands sharing their first letter with another
+    // one are spelled in full). The characters are read in place, nothing is allocated.
+    if (mxIsEmpty(prhs[0]))
+        mexErrMsgTxt("No valid action specified : o / w / r / p / e / s / l / n / t / q / d / c");
+    action = mxGetChars(prhs[0]);
+
+    // a longer name must be a command: a mistyped one ('waituntill') would run the command of its first letter
+    if (mxGetNumberOfElements(prhs[0]) > 1)
+    {
+        static const char *commands[] = {"write", "read", "pulse", "events", "log", "now", "open", "close",
+                                         "waituntil", "waitresponse", "rtconfig", "record", "rule", "sim",
+                                         "schedule", "stats", "set", "share", "decode", "queue", "toggle",
+                                         "train", "capture", "clear"};
+        size_t k = 0;
+
+        while (k < sizeof(commands) / sizeof(commands[0]) && !isAction(prhs[0], commands[k]))
+            k++;
+        if (k == sizeof(commands) / sizeof(commands[0]))
+        {
+            mxGetString(prhs[0], user_address, sizeof(user_address));
+            mexErrMsgIdAndTxt("ppMEG:command", "Unknown command '%s'", user_address);
+        }
+    }
+
+    switch (action[0])
+    {
+    case 'o': // ppMEG('open'[, ports[, roles]][, backend])
+        stopThreads();
+        // the backend is the last argument, the addresses start with '/'
+        backend = &ppdev_backend;
+        n_args = nrhs;
+        if (nrhs > 1 && mxIsChar(prhs[nrhs - 1]))
+        {
+            mxGetString(prhs[nrhs - 1], option, sizeof(option));
+            for (int k = 0; k < sizeof(backends) / sizeof(backends[0]); k++)
+            {
+                if (strcmp(option, backends[k]->name) == 0)
+                {
+                    backend = backends[k];
+                    n_args--;
+                }
+            }
+        }
+        if (n_args > 3)
+            mexErrMsgTxt("Incorrect number of arguments.");
+
+        // all the ports are closed, the table is then rebuilt
+        unloadAll();
+        if (n_args == 1)
+        {
+            // no port address specified : default table
+            port_count = sizeof(default_ports) / sizeof(default_ports[0]);
+            for (int i = 0; i < port_count; i++)
+                configurePort(i, default_ports[i].address, default_ports[i].role);
+        }
+        else if (mxIsCell(prhs[1]))
+        {
+            // list of addresses, response ports unless the roles are given
+            n = mxGetNumberOfElements(prhs[1]);
+            if (n == 0 || n > PARPORT_MAX)
+                mexErrMsgTxt("The list of ports must contain 1 to 16 addresses");
+            for (int i = 0; i < n; i++)
+            {
+                const mxArray *address = mxGetCell(prhs[1], i);
+                if (address == NULL || !mxIsChar(address) ||
+                    mxGetString(address, user_address, sizeof(user_address)) != 0)
+                    mexErrMsgTxt("The port addresses must be strings");
+                if (user_address[0] != '/' && backend != &sim_backend)
+                    mexErrMsgTxt("The port addresses must be device paths, e.g. '/dev/parport0'");
+                configurePort(i, user_address, PORT_IN);
+            }
+            port_count = n;
+        }
+        else
+        {
+            if (!mxIsChar(prhs[1]) || mxGetString(prhs[1], user_address, sizeof(user_address)) != 0)
+                mexErrMsgTxt("The port address must be a string");
+            if (strcmp(user_address, "discover") == 0)
+            {
+                // every /dev/parport* present, response ports unless the roles are given
+                port_count = discoverPorts();
+                if (port_count == 0)
+                    mexErrMsgTxt("No /dev/parport* device found");
+            }
+            else
+            {
+                // the user specifies one address: this port is read and written
+                if (user_address[0] != '/' && n_args == nrhs)
+                    mexErrMsgTxt("Unknown backend : 'ppdev' / 'ioport' / 'sim'");
+                if (user_address[0] != '/' && backend != &sim_backend)
+                    mexErrMsgTxt("The port address must be a device path, e.g. '/dev/parport0'");
+                configurePort(0, user_address, PORT_IN | PORT_OUT);
+                port_count = 1;
+            }
+        }
+        if (n_args == 3)
+            setPortRoles(prhs[2], port_count);
+
+        // only one port can receive the triggers
+        for (int i = 0; i < port_count; i++)
+        {
+            if (!(pports[i].role & PORT_OUT))
+                continue;
+            if (writing_port_idx >= 0)
+            {
+                port_count = 0;
+                writing_port_idx = -1;
+                mexErrMsgTxt("Only one port can have the output role ('o' or 'b')");
+            }
+            writing_port_idx = i;
+        }
+        for (int i = 0; i < port_count; i++)
+            openPort(&pports[i], pports[i].address, backend);
+        calibrateWait();
+        break;
+
+    case 'w': // ppMEG('write', message), ppMEG('waituntil', ...) or ppMEG('waitresponse', ...)
+        if (isAction(prhs[0], "waitresponse"))
+        {
+            // [port, value, rt, t] = ppMEG('waitresponse', mask, timeout_s[, period_us])
+            // rt is measured from the end of the last write of a non-zero value (NaN if none)
+            uint64_t t_detect = 0, t_trigger;
+            int port;
+
+            if (nrhs < 3 || nrhs > 4)
+                mexErrMsgTxt("ppMEG('waitresponse', mask, timeout_s[, period_us])");
+            if (port_count == 0)
+                mexErrMsgTxt("Parallel port was not opened \n");
+            width = mxGetScalar(prhs[2]);
+            if (!(width >= 0) || width > 1e6)
+                mexErrMsgTxt("The timeout must be given in s");
+
+            port = waitResponse((unsigned char)mxGetScalar(prhs[1]), (uint64_t)(width * 1e9),
+                                nrhs > 3 ? (uint64_t)(mxGetScalar(prhs[3]) * 1e3) : 0, &message, &t_detect);
+            t_trigger = atomic_load_explicit(&last_trigger_ns, memory_order_relaxed);
+
+            plhs[0] = mxCreateDoubleScalar(port + 1);
+            if (nlhs > 1)
+                plhs[1] = mxCreateDoubleScalar(port >= 0 ? message : mxGetNaN());
+            if (nlhs > 2)
+                plhs[2] = mxCreateDoubleScalar(port >= 0 && t_trigger > 0 ? ((int64_t)(t_detect - t_trigger)) * 1e-9 : mxGetNaN());
+            if (nlhs > 3)
+                plhs[3] = mxCreateDoubleScalar(port >= 0 ? t_detect * 1e-9 : mxGetNaN());
+            break;
+        }
+        if (isAction(prhs[0], "waituntil"))
+        {
+            if (nrhs > 1 && mxIsChar(prhs[1]))
+            {
+                // ppMEG('waituntil', 'margin'[, margin_us]), the margin is kept within the bounds of calibrateWait
+                if (mxGetString(prhs[1], user_address, sizeof(user_address)) != 0 ||
+                    strcmp(user_address, "margin") != 0)
+                    mexErrMsgIdAndTxt("ppMEG:waituntil", "Unknown waituntil option '%s' : 'margin'", user_address);
+                if (nrhs > 2)
+                {
+                    width = mxGetScalar(prhs[2]);
+                    if (!(width >= 0))
+                        mexErrMsgTxt("The margin must be positive");
+                    width = fmin(fmax(width * 1e3, WAIT_MARGIN_MIN_NS), WAIT_MARGIN_MAX_NS);
+                    wait_margin_ns = (uint64_t)width;
+                }
+                plhs[0] = mxCreateDoubleScalar(wait_margin_ns * 1e-3);
+                break;
+            }
+            if (nrhs != 2)
+                mexErrMsgTxt("ppMEG('waituntil', t) with t in s, on the clock of ppMEG('now')");
+            // a deadline in the past returns immediately with its (positive) overshoot. The wait cannot be
+            // interrupted: t is at most 1e6 s ahead, as the timeout of 'waitresponse'
+            width = mxGetScalar(prhs[1]);
+            if (!isfinite(width) || width > monotonicNs() * 1e-9 + 1e6)
+                mexErrMsgTxt("t must be a time of ppMEG('now'), at most 1e6 s ahead");
+            plhs[0] = mxCreateDoubleScalar(waitUntil(width > 0 ? (uint64_t)(width * 1e9) : 0, NULL) * 1e-9);
+            break;
+        }
+
+        if (nrhs != 2)
+            mexErrMsgTxt("You need to specify the message to send [0-255]");
+
+        message = (unsigned char)mxGetScalar(prhs[1]); // Fetch the input value
+        checkPort(writeTrigger(message), "PPWDATA");
+
+        break;
+
+    case 'p': // ppMEG('pulse', message, width_us[, mask]) or [t_high, t_low] = ppMEG('pulse')
+        if (nrhs == 1)
+        {
+            // timestamps of the last pulse, t_low is NaN while the reset of one of its bits is pending
+            double t_high;
+
+            pthread_mutex_lock(&data_mutex);
+            t_high = pulse_high_ns * 1e-9;
+            width = pulse_low_ns * 1e-9;
+            for (int b = 0; b < 8; b++)
+                if ((pulse_mask & (1 << b)) && pulse_deadlines[b] != 0)
+                    width = mxGetNaN();
+            pthread_mutex_unlock(&data_mutex);
+            plhs[0] = mxCreateDoubleScalar(t_high);
+            if (nlhs > 1)
+                plhs[1] = mxCreateDoubleScalar(width);
+            break;
+        }
+        if (nrhs != 3 && nrhs != 4)
+            mexErrMsgTxt("You need to specify the message to send [0-255] and the pulse width in us (and the bits)");
+
+        // the bits of the mask take the bits of the message and go back to 0 after the width, the other
+        // bits are unchanged (the default mask is the whole port)
+        message = (unsigned char)mxGetScalar(prhs[1]);
+        width = mxGetScalar(prhs[2]);
+        if (!(width > 0))
+            mexErrMsgTxt("The pulse width must be positive");
+        {
+            unsigned char mask = nrhs > 3 ? (unsigned char)mxGetScalar(prhs[3]) : 0xFF;
+
+            if (mask == 0)
+                mexErrMsgTxt("The mask of the pulse has no bit");
+            startPulseThread();
+            err = startPulse(message, mask, (uint64_t)(width * 1e3));
+        }
+        checkPort(err, "PPWDATA");
+
+        plhs[0] = mxCreateDoubleScalar(pulse_high_ns * 1e-9);
+        break;
+
+    case 'r': // ppMEG('read'), ppMEG('rtconfig', ...), ppMEG('record', ...) or ppMEG('rule', ...)
+        if (isAction(prhs[0], "rule"))
+        {
+            // id = ppMEG('rule', port, bit, code[, width_us][, 'fall'][, 'repeat']), ppMEG('rule', 'arm' | 'disarm'[, ids]),
+            // ppMEG('rule', 'clear') or rules = ppMEG('rule')
+            if (nrhs == 1)
+            {
+                static const char *fields[] = {"port", "bit", "code", "width_us", "fall", "repeat", "armed", "fired",
+                                               "latency"};
+
+                n = atomic_load(&rule_count);
+                plhs[0] = mxCreateStructMatrix(n, 1, sizeof(fields) / sizeof(fields[0]), fields);
+                for (int k = 0; k < n; k++)
+                {
+                    const Rule *rule = &rules[k];
+                    uint64_t fired = atomic_load(&rule->fired);
+                    int bit = 0;
+
+                    while (!(rule->mask & (1 << bit)))
+                        bit++;
+                    mxSetFieldByNumber(plhs[0], k, 0, mxCreateDoubleScalar(rule->port + 1));
+                    mxSetFieldByNumber(plhs[0], k, 1, mxCreateDoubleScalar(bit));
+                    mxSetFieldByNumber(plhs[0], k, 2, mxCreateDoubleScalar(rule->code));
+                    mxSetFieldByNumber(plhs[0], k, 3, mxCreateDoubleScalar(rule->width_ns * 1e-3));
+                    mxSetFieldByNumber(plhs[0], k, 4, mxCreateDoubleScalar(rule->falling));
+                    mxSetFieldByNumber(plhs[0], k, 5, mxCreateDoubleScalar(rule->repeat));
+                    mxSetFieldByNumber(plhs[0], k, 6, mxCreateDoubleScalar(atomic_load(&rule->armed)));
+                    mxSetFieldByNumber(plhs[0], k, 7, mxCreateDoubleScalar(fired));
+                    mxSetFieldByNumber(plhs[0], k, 8, mxCreateDoubleScalar(
+                        fired > 0 ? atomic_load(&rule->latency_ns) * 1e-9 : mxGetNaN()));
+                }
+                break;
+            }
+            if (mxIsChar(prhs[1]))
+            {
+                int arm;
+
+                mxGetString(prhs[1], option, sizeof(option));
+                if (strcmp(option, "clear") == 0)
+                {
+                    pthread_mutex_lock(&rule_mutex);
+                    atomic_store(&rule_count, 0);
+                    pthread_mutex_unlock(&rule_mutex);
+                    break;
+                }
+                if (strcmp(option, "arm") != 0 && strcmp(option, "disarm") != 0)
+                    mexErrMsgTxt("Unknown rule option : 'arm' / 'disarm' / 'clear'");
+
+                // all the rules, or the given ones (from 1, order of creation)
+                arm = strcmp(option, "arm") == 0;
+                n = atomic_load(&rule_count);
+                if (nrhs > 2 && !mxIsDouble(prhs[2]))
+                    mexErrMsgTxt("The rules must be a vector of rule numbers (from 1)");
+                for (size_t k = 0; k < (nrhs > 2 ? mxGetNumberOfElements(prhs[2]) : n); k++)
+                {
+                    int id = nrhs > 2 ? (int)mxGetPr(prhs[2])[k] - 1 : (int)k;
+
+                    if (id < 0 || id >= n)
+                        mexErrMsgTxt("Unknown rule number");
+                    atomic_store(&rules[id].armed, arm);
+                }
+                break;
+            }
+
+            if (nrhs < 4)
+                mexErrMsgTxt("ppMEG('rule', port, bit, code[, width_us][, 'fall'][, 'repeat'])");
+            {
+                int idx = (int)mxGetScalar(prhs[1]) - 1, bit = (int)mxGetScalar(prhs[2]), falling = 0, repeat = 0;
+                uint64_t width_ns = 0;
+
+                if (idx < 0 || idx >= port_count || pports[idx].backend == NULL || !(pports[idx].role & PORT_IN))
+                    mexErrMsgTxt("The port of a rule must be an opened response port (from 1, order of the port table)");
+                if (bit < 0 || bit > 7)
+                    mexErrMsgTxt("The bit of a rule must be in [0-7] (bits of the value returned by 'read')");
+                if (writing_port_idx < 0)
+                    mexErrMsgTxt("There is no trigger port for the rules");
+                for (int k = 4; k < nrhs; k++)
+                {
+                    if (!mxIsChar(prhs[k]))
+                    {
+                        width = mxGetScalar(prhs[k]);
+                        if (!(width >= 0))
+                            mexErrMsgTxt("The pulse width must be positive (in us, 0 for no pulse)");
+                        width_ns = (uint64_t)(width * 1e3);
+                        continue;
+                    }
+                    mxGetString(prhs[k], option, sizeof(option));
+                    if (strcmp(option, "fall") == 0)
+                        falling = 1;
+                    else if (strcmp(option, "repeat") == 0)
+                        repeat = 1;
+                    else
+                        mexErrMsgTxt("Unknown rule option : 'fall' / 'repeat'");
+                }
+                if (width_ns > 0)
+                    startPulseThread();
+
+                pthread_mutex_lock(&rule_mutex);
+                n = atomic_load(&rule_count);
+                if (n < RULE_MAX)
+                {
+                    Rule *rule = &rules[n];
+
+                    rule->port = idx;
+                    rule->mask = 1 << bit;
+                    rule->code = (unsigned char)mxGetScalar(prhs[3]);
+                    rule->falling = falling;
+                    rule->repeat = repeat;
+                    rule->width_ns = width_ns;
+                    atomic_store(&rule->fired, 0);
+                    atomic_store(&rule->latency_ns, 0);
+                    atomic_store(&rule->armed, 1);
+                    atomic_store(&rule_count, n + 1);
+                }
+                pthread_mutex_unlock(&rule_mutex);
+                if (n == RULE_MAX)
+                    mexErrMsgTxt("Too many rules, ppMEG('rule', 'clear') first");
+                plhs[0] = mxCreateDoubleScalar(n + 1);
+            }
+            break;
+        }
+        if (isAction(prhs[0], "record"))
+        {
+            // ppMEG('record', file[, period_us]), ppMEG('record', 'stop') or info = ppMEG('record')
+            if (nrhs == 1)
+            {
+                static const char *fields[] = {"running", "file", "records", "error"};
+
+                plhs[0] = mxCreateStructMatrix(1, 1, sizeof(fields) / sizeof(fields[0]), fields);
+                mxSetFieldByNumber(plhs[0], 0, 0, mxCreateDoubleScalar(record_thread_running));
+                mxSetFieldByNumber(plhs[0], 0, 1, mxCreateString(record_path));
+                mxSetFieldByNumber(plhs[0], 0, 2, mxCreateDoubleScalar(
+                    record_header != NULL ? atomic_load(&record_header->n_records) : record_n));
+                mxSetFieldByNumber(plhs[0], 0, 3, mxCreateString(record_error != 0 ? strerror(record_error) : ""));
+                break;
+            }
+            if (!mxIsChar(prhs[1]) || mxGetString(prhs[1], user_address, sizeof(user_address)) != 0)
+                mexErrMsgTxt("ppMEG('record', file[, period_us]) or ppMEG('record', 'stop')");
+            if (strcmp(user_address, "stop") == 0)
+            {
+                stopRecordThread();
+                break;
+            }
+            width = nrhs > 2 ? mxGetScalar(prhs[2]) : 0;
+            if (!(width >= 0))
+                mexErrMsgTxt("The period must be positive (in us)");
+            startRecordThread(user_address, (uint64_t)(width * 1e3));
+            break;
+        }
+        if (isAction(prhs[0], "rtconfig"))
+        {
+            // report = ppMEG('rtconfig'[, 'priority', 0-99][, 'cpu', index or -1][, 'lock', true / false / 'all'])
+            for (int k = 1; k + 1 < nrhs; k += 2)
+            {
+                if (!mxIsChar(prhs[k]) || mxGetString(prhs[k], option, sizeof(option)) != 0)
+                    mexErrMsgTxt("Unknown rtconfig setting : priority / cpu / lock");
+                if (strcmp(option, "priority") == 0)
+                {
+                    rt_priority = (int)mxGetScalar(prhs[k + 1]);
+                    if (rt_priority < 0 || rt_priority > sched_get_priority_max(SCHED_FIFO))
+                        mexErrMsgTxt("The priority must be between 0 (default scheduling) and 99");
+                }
+                else if (strcmp(option, "cpu") == 0)
+                {
+                    rt_cpu = (int)mxGetScalar(prhs[k + 1]);
+                    if (rt_cpu < -1 || rt_cpu >= CPU_SETSIZE)
+                        mexErrMsgTxt("The cpu must be a CPU index (from 0) or -1 for all CPUs");
+                }
+                else if (strcmp(option, "lock") == 0)
+                {
+                    if (mxIsChar(prhs[k + 1]))
+                    {
+                        mxGetString(prhs[k + 1], option, sizeof(option));
+                        if (strcmp(option, "all") != 0)
+                            mexErrMsgTxt("The lock setting must be true, false or 'all'");
+                        rt_lock = 2;
+                    }
+                    else
+                        rt_lock = mxGetScalar(prhs[k + 1]) != 0;
+                }
+                else
+                    mexErrMsgTxt("Unknown rtconfig setting : priority / cpu / lock");
+            }
+            if (nrhs % 2 == 0)
+                mexErrMsgTxt("The rtconfig settings are given as name / value pairs");
+
+            plhs[0] = applyRtConfig();
+            break;
+        }
+
+        if (nrhs != 1)
+            mexErrMsgTxt("Error calling read: no argument should be given");
+
+        if (port_count == 0)
+            mexErrMsgTxt("Parallel port was not opened \n");
+
+        // assign output message to the array of left-side arguments, one per response port
+        // for sake of simplicity, char is cast to double value
+        for (int i = 0, k = 0; i < port_count; i++)
+        {
+            if (!(pports[i].role & PORT_IN))
+                continue;
+            checkPort(readButtons(&message, i), "PPRSTATUS");
+            // fill-in the left-hand side array with each value read
+            if (k < nlhs || k == 0)
+                plhs[k] = mxCreateDoubleScalar(message);
+            k++;
+        }
+
+        break;
+
+    case 'e': // ppMEG('events', 'start'[, period_us | 'irq']), ppMEG('events', 'stop') or [port, old, new, t, n_dropped] = ppMEG('events'[, 'native'])
+        if (nrhs > 1 && !mxIsChar(prhs[1]))
+            mexErrMsgTxt("Unknown events option : 'start' / 'stop' / 'native'");
+        if (nrhs > 1 && !isAction(prhs[1], "native"))
+        {
+            mxGetString(prhs[1], option, sizeof(option));
+            if (strcmp(option, "start") == 0)
+            {
+                if (port_count == 0)
+                    mexErrMsgTxt("Parallel port was not opened \n");
+                if (nrhs > 2 && mxIsChar(prhs[2]))
+                {
+                    mxGetString(prhs[2], option, sizeof(option));
+                    if (strcmp(option, "irq") != 0)
+                        mexErrMsgTxt("Unknown events mode : period in us or 'irq'");
+                    startEventThread(0, 1);
+                    break;
+                }
+                width = nrhs > 2 ? mxGetScalar(prhs[2]) : 0;
+                startEventThread(width > 0 ? (uint64_t)(width * 1e3) : 0, 0);
+            }
+            else if (strcmp(option, "stop") == 0)
+                stopEventThread();
+            else
+                mexErrMsgTxt("Unknown events option : 'start' / 'stop'");
+            break;
+        }
+
+        // drain the whole ring in one shot, ports are numbered from 1 in the order of the port table
+        // with 'native', each column is copied as is (uint8 port / old / new, uint64 t in ns), without conversion
+        {
+            uint_fast64_t tail = atomic_load_explicit(&event_tail, memory_order_relaxed);
+            uint_fast64_t head = atomic_load_explicit(&event_head, memory_order_acquire);
+            size_t n = head - tail;
+            mxArray *outputs[4];
+
+            if (nrhs > 1)
+            {
+                const void *rings[4] = {event_port, event_old, event_new, event_t_ns};
+                const size_t sizes[4] = {1, 1, 1, sizeof(uint64_t)};
+                const mxClassID classes[4] = {mxUINT8_CLASS, mxUINT8_CLASS, mxUINT8_CLASS, mxUINT64_CLASS};
+
+                for (int k = 0; k < 4; k++)
+                    outputs[k] = k < nlhs || k == 0 ? adoptMatrix(copyRing(rings[k], sizes[k], EVENT_RING_SIZE, tail, n), n, 1, classes[k])
+                                                    : NULL;
+            }
+            else
+            {
+                double *columns[4];
+
+                for (int k = 0; k < 4; k++)
+                {
+                    outputs[k] = mxCreateDoubleMatrix(n, 1, mxREAL);
+                    columns[k] = mxGetPr(outputs[k]);
+                }
+                for (size_t j = 0; j < n; j++)
+                {
+                    size_t slot = (tail + j) & (EVENT_RING_SIZE - 1);
+                    columns[0][j] = event_port[slot];
+                    columns[1][j] = event_old[slot];
+                    columns[2][j] = event_new[slot];
+                    columns[3][j] = event_t_ns[slot] * 1e-9;
+                }
+            }
+            atomic_store_explicit(&event_tail, head, memory_order_release);
+
+            for (int k = 0; k < 4; k++)
+            {
+                if (k < nlhs || k == 0)
+                    plhs[k] = outputs[k];
+                else if (outputs[k] != NULL)
+                    mxDestroyArray(outputs[k]);
+            }
+            if (nlhs > 4)
+                plhs[4] = mxCreateDoubleScalar(atomic_exchange(&event_dropped, 0));
+        }
+        break;
+
+    case 's': // ppMEG('sim', setting, value, ...), ppMEG('schedule', ...), ppMEG('stats'[, 'reset']), ppMEG('set', mask) or ppMEG('share', ...)
+        if (isAction(prhs[0], "share"))
+        {
+            // ppMEG('share', name), ppMEG('share', 'stop') or info = ppMEG('share')
+            if (nrhs == 1)
+            {
+                static const char *fields[] = {"running", "name", "records"};
+                PPMEGShmHeader *header = atomic_load(&shm_header);
+
+                plhs[0] = mxCreateStructMatrix(1, 1, sizeof(fields) / sizeof(fields[0]), fields);
+                mxSetFieldByNumber(plhs[0], 0, 0, mxCreateDoubleScalar(header != NULL));
+                mxSetFieldByNumber(plhs[0], 0, 1, mxCreateString(header != NULL ? shm_name : ""));
+                mxSetFieldByNumber(plhs[0], 0, 2, mxCreateDoubleScalar(header != NULL ? atomic_load(&header->head) : 0));
+                break;
+            }
+            if (!mxIsChar(prhs[1]) || mxGetString(prhs[1], user_address, sizeof(user_address)) != 0)
+                mexErrMsgTxt("ppMEG('share', name) or ppMEG('share', 'stop')");
+            if (strcmp(user_address, "stop") == 0)
+                stopShare();
+            else
+                startShare(user_address);
+            break;
+        }
+        if (isAction(prhs[0], "set"))
+        {
+            // value = ppMEG('set', mask): the DATA bits of the mask go to 1, the others are unchanged
+            if (nrhs != 2)
+                mexErrMsgTxt("ppMEG('set', mask) with mask in [0-255]");
+            message = (unsigned char)mxGetScalar(prhs[1]);
+            checkPort(modifyData(~message, message, writing_port_idx, &message), "PPWDATA");
+            if (nlhs > 0)
+                plhs[0] = mxCreateDoubleScalar(message);
+            break;
+        }
+        if (isAction(prhs[0], "stats"))
+        {
+            // stats = ppMEG('stats'): one element per histogram (writes of the output port, reads of each
+            // response port, then the others), times in s (NaN if empty)
+            static const char *fields[] = {"name", "port", "count", "min", "p50", "p90", "p99", "p999", "max", "mean"};
+            static const double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+            size_t n_entries = sizeof(stats_entries) / sizeof(stats_entries[0]);
+            StatsEntry entries[2 * PARPORT_MAX + sizeof(stats_entries) / sizeof(stats_entries[0])];
+
+            if (nrhs > 1)
+            {
+                if (!mxIsChar(prhs[1]) || mxGetString(prhs[1], option, sizeof(option)) != 0 ||
+                    strcmp(option, "reset") != 0)
+                    mexErrMsgTxt("Unknown stats option : 'reset'");
+                for (int i = 0; i < PARPORT_MAX; i++)
+                {
+                    histogramReset(&pports[i].write_hist);
+                    histogramReset(&pports[i].read_hist);
+                }
+                for (size_t k = 0; k < n_entries; k++)
+                    histogramReset(stats_entries[k].histogram);
+                break;
+            }
+
+            n = 0;
+            for (int i = 0; i < port_count; i++)
+            {
+                if (pports[i].role & PORT_OUT)
+                    entries[n++] = (StatsEntry){"write", i + 1, &pports[i].write_hist};
+                if (pports[i].role & PORT_IN)
+                    entries[n++] = (StatsEntry){"read", i + 1, &pports[i].read_hist};
+            }
+            for (size_t k = 0; k < n_entries; k++)
+                entries[n++] = stats_entries[k];
+
+            plhs[0] = mxCreateStructMatrix(n, 1, sizeof(fields) / sizeof(fields[0]), fields);
+            for (int k = 0; k < n; k++)
+            {
+                const Histogram *histogram = entries[k].histogram;
+                uint64_t count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+
+                mxSetFieldByNumber(plhs[0], k, 0, mxCreateString(entries[k].name));
+                mxSetFieldByNumber(plhs[0], k, 1, mxCreateDoubleScalar(entries[k].port));
+                mxSetFieldByNumber(plhs[0], k, 2, mxCreateDoubleScalar(count));
+                mxSetFieldByNumber(plhs[0], k, 3, mxCreateDoubleScalar(
+                    count > 0 ? ~atomic_load(&histogram->min_inv_ns) * 1e-9 : mxGetNaN()));
+                for (int p = 0; p < 4; p++)
+                    mxSetFieldByNumber(plhs[0], k, 4 + p, mxCreateDoubleScalar(
+                        count > 0 ? histogramPercentile(histogram, percentiles[p]) * 1e-9 : mxGetNaN()));
+                mxSetFieldByNumber(plhs[0], k, 8, mxCreateDoubleScalar(
+                    count > 0 ? atomic_load(&histogram->max_ns) * 1e-9 : mxGetNaN()));
+                mxSetFieldByNumber(plhs[0], k, 9, mxCreateDoubleScalar(
+                    count > 0 ? (double)atomic_load(&histogram->sum_ns) / count * 1e-9 : mxGetNaN()));
+            }
+            break;
+        }
+        if (isAction(prhs[0], "schedule"))
+        {
+            if (nrhs == 1)
+            {
+                // [lateness, n_played] = ppMEG('schedule')
+                size_t n_played = atomic_load_explicit(&schedule_played, memory_order_acquire);
+                double *lateness;
+
+                plhs[0] = mxCreateDoubleMatrix(schedule_n, 1, mxREAL);
+                lateness = mxGetPr(plhs[0]);
+                for (size_t k = 0; k < schedule_n; k++)
+                    lateness[k] = k < n_played ? schedule_lateness_ns[k] * 1e-9 : mxGetNaN();
+                if (nlhs > 1)
+                    plhs[1] = mxCreateDoubleScalar(n_played);
+            }
+            else if (nrhs == 2 && mxIsChar(prhs[1]))
+            {
+                // ppMEG('schedule', 'cancel'): the messages already played are kept
+                stopScheduleThread();
+            }
+            else if (nrhs == 2 && mxIsDouble(prhs[1]) && mxGetN(prhs[1]) == 2)
+            {
+                // ppMEG('schedule', [times values])
+                startSchedule(mxGetPr(prhs[1]), mxGetPr(prhs[1]) + mxGetM(prhs[1]), mxGetM(prhs[1]));
+            }
+            else if (nrhs == 3 && mxIsDouble(prhs[1]) && mxIsDouble(prhs[2]) &&
+                     mxGetNumberOfElements(prhs[1]) == mxGetNumberOfElements(prhs[2]))
+            {
+                startSchedule(mxGetPr(prhs[1]), mxGetPr(prhs[2]), mxGetNumberOfElements(prhs[1]));
+            }
+            else
+                mexErrMsgTxt("ppMEG('schedule', times, messages) or ppMEG('schedule', [times messages])");
+            break;
+        }
+
+        for (int k = 1; k < nrhs; k++)
+        {
+            if (!mxIsChar(prhs[k]) || mxGetString(prhs[k], option, sizeof(option)) != 0)
+                mexErrMsgTxt("Unknown sim setting : latency / jitter / status / loopback / data");
+
+            if (strcmp(option, "data") == 0)
+            {
+                // DATA pins of the simulated writing port
+                if (writing_port_idx < 0)
+                    mexErrMsgTxt("No output port");
+                plhs[0] = mxCreateDoubleScalar(atomic_load(&pports[writing_port_idx].sim_data));
+                continue;
+            }
+            if (k + 1 >= nrhs)
+                mexErrMsgTxt("Missing value of the sim setting");
+
+            if (strcmp(option, "latency") == 0)
+                sim_latency_ns = (uint64_t)(mxGetScalar(prhs[++k]) * 1e3);
+            else if (strcmp(option, "jitter") == 0)
+                sim_jitter_ns = (uint64_t)(mxGetScalar(prhs[++k]) * 1e3);
+            else if (strcmp(option, "status") == 0 || strcmp(option, "loopback") == 0)
+            {
+                // port number (from 1, order of the port table), then the STATUS values and their times
+                int idx = (int)mxGetScalar(prhs[++k]) - 1;
+                if (idx < 0 || idx >= port_count || pports[idx].backend != &sim_backend)
+                    mexErrMsgTxt("The port is not a simulated port");
+
+                if (option[0] == 'l')
+                {
+                    // STATUS pins of the port connected to the DATA pins of the writing port
+                    if (writing_port_idx < 0)
+                        mexErrMsgTxt("No output port");
+                    pports[idx].sim_loopback = writing_port_idx;
+                    continue;
+                }
+                pports[idx].sim_loopback = -1;
+                if (k + 1 >= nrhs)
+                    mexErrMsgTxt("Missing STATUS values");
+                {
+                    const mxArray *values = prhs[++k];
+                    const mxArray *times = k + 1 < nrhs && !mxIsChar(prhs[k + 1]) ? prhs[++k] : NULL;
+                    size_t n = mxGetNumberOfElements(values);
+                    uint64_t now = monotonicNs();
+                    uint64_t *t_ns;
+                    unsigned char *status;
+
+                    if (n == 0 || !mxIsDouble(values) || (times != NULL && (mxGetNumberOfElements(times) != n || !mxIsDouble(times))))
+                        mexErrMsgTxt("The STATUS values and their times (in s from now) must be double vectors of the same length");
+
+                    // the script is copied by setSimScript, the temporary arrays are freed by Matlab
+                    t_ns = mxMalloc(n * sizeof(uint64_t));
+                    status = mxMalloc(n);
+                    for (size_t j = 0; j < n; j++)
+                    {
+                        status[j] = (unsigned char)mxGetPr(values)[j];
+                        t_ns[j] = times != NULL ? now + (uint64_t)(mxGetPr(times)[j] * 1e9) : now;
+                    }
+                    setSimScript(&pports[idx], times != NULL ? t_ns : NULL, status, n);
+                    mxFree(t_ns);
+                    mxFree(status);
+                }
+            }
+            else
+                mexErrMsgTxt("Unknown sim setting : latency / jitter / status / loopback / data");
+        }
+        break;
+
+    case 'l': // [seq, value, t_before, t_after, port] = ppMEG('log'[, 'native']) or ppMEG('log', 'reset')
+        if (nrhs > 1 && !mxIsChar(prhs[1]))
+            mexErrMsgTxt("Unknown log option : 'reset' / 'native'");
+        if (nrhs > 1 && !isAction(prhs[1], "native"))
+        {
+            mxGetString(prhs[1], option, sizeof(option));
+            if (strcmp(option, "reset") != 0)
+                mexErrMsgTxt("Unknown log option : 'reset' / 'native'");
+            atomic_store(&write_log_start, atomic_load(&write_log_seq));
+            break;
+        }
+
+        // with 'native', the columns are filled in their own class (uint32 seq, uint8 value and port, uint64 times
+        // in ns) and handed to Matlab as they are
+        {
+            uint_fast64_t end = atomic_load_explicit(&write_log_seq, memory_order_acquire);
+            uint_fast64_t start = atomic_load(&write_log_start);
+            int native = nrhs > 1;
+            mxArray *outputs[5];
+            size_t n = 0, count;
+
+            if (end - start > WRITE_LOG_SIZE)
+                start = end - WRITE_LOG_SIZE;
+            count = end - start;
+
+            if (native)
+            {
+                const void *columns[4] = {write_log.value, write_log.t_before_ns, write_log.t_after_ns,
+                                          write_log.port};
+                const size_t sizes[4] = {1, sizeof(uint64_t), sizeof(uint64_t), 1};
+                const mxClassID classes[4] = {mxUINT8_CLASS, mxUINT64_CLASS, mxUINT64_CLASS, mxUINT8_CLASS};
+                uint32_t *seqs = count ? mxMalloc(count * sizeof(uint32_t)) : NULL;
+
+                // the records still being written (or already overwritten) by another thread are left out
+                for (uint_fast64_t seq = start; seq < end; seq++)
+                {
+                    const atomic_uint_fast64_t *done_seq = &write_log.done_seq[seq & (WRITE_LOG_SIZE - 1)];
+
+                    if (atomic_load_explicit(done_seq, memory_order_acquire) == seq + 1)
+                        seqs[n++] = (uint32_t)(seq + 1);
+                }
+                outputs[0] = adoptMatrix(seqs, n, 1, mxUINT32_CLASS);
+
+                // each column is copied in one piece (two at the end of the ring), then packed in place if records
+                // were left out (rare: a write of another thread during the call)
+                for (int k = 0; k < 4; k++)
+                {
+                    char *data = k + 1 < nlhs ? copyRing(columns[k], sizes[k], WRITE_LOG_SIZE, start, count) : NULL;
+
+                    for (size_t i = 0; data != NULL && n < count && i < n; i++)
+                        memmove(data + i * sizes[k], data + (uint32_t)(seqs[i] - 1 - start) * sizes[k], sizes[k]);
+                    outputs[k + 1] = data != NULL ? adoptMatrix(data, n, 1, classes[k]) : NULL;
+                }
+            }
+            else
+            {
+                double *columns[5];
+
+                for (int k = 0; k < 5; k++)
+                {
+                    outputs[k] = mxCreateDoubleMatrix(count, 1, mxREAL);
+                    columns[k] = mxGetPr(outputs[k]);
+                }
+                for (uint_fast64_t seq = start; seq < end; seq++)
+                {
+                    size_t i = seq & (WRITE_LOG_SIZE - 1);
+
+                    if (atomic_load_explicit(&write_log.done_seq[i], memory_order_acquire) != seq + 1)
+                        continue;
+                    columns[0][n] = seq + 1;
+                    columns[1][n] = write_log.value[i];
+                    columns[2][n] = write_log.t_before_ns[i] * 1e-9;
+                    columns[3][n] = write_log.t_after_ns[i] * 1e-9;
+                    columns[4][n] = write_log.port[i];
+                    n++;
+                }
+                for (int k = 0; k < 5; k++)
+                    mxSetM(outputs[k], n);
+            }
+            for (int k = 0; k < 5; k++)
+            {
+                if (k < nlhs || k == 0)
+                    plhs[k] = outputs[k];
+                else
+                    mxDestroyArray(outputs[k]);
+            }
+        }
+        break;
+
+    case 'n': // t = ppMEG('now'), in s, same clock as all the timestamps of ppMEG
+        plhs[0] = mxCreateDoubleScalar(monotonicNs() * 1e-9);
+        break;
+
+    case 'd': // ppMEG('decode', ports, bits[, invert]), ppMEG('decode', ports, 'raw') or table = ppMEG('decode', port)
+        if (!isAction(prhs[0], "decode"))
+            mexErrMsgTxt("No valid action specified : o / w / r / p / e / s / l / n / t / q / d / c");
+        if (nrhs < 2 || nrhs > 4 || !mxIsDouble(prhs[1]) || mxIsEmpty(prhs[1]))
+            mexErrMsgTxt("ppMEG('decode', ports, bits[, invert]), ppMEG('decode', ports, 'raw') or ppMEG('decode', port)");
+        n = mxGetNumberOfElements(prhs[1]);
+        for (int j = 0; j < n; j++)
+        {
+            int idx = (int)mxGetPr(prhs[1])[j] - 1;
+            if (idx < 0 || idx >= port_count)
+                mexErrMsgTxt("Unknown port (from 1, order of the port table)");
+        }
+        if (nrhs == 2)
+        {
+            // current table of a port, uint8 256 x 1 (entry raw + 1)
+            plhs[0] = mxCreateNumericMatrix(256, 1, mxUINT8_CLASS, mxREAL);
+            memcpy(mxGetData(plhs[0]), pports[(int)mxGetPr(prhs[1])[0] - 1].decode, 256);
+            break;
+        }
+        {
+            // the STATUS bits of the buttons, in the order of the bits of the decoded value; BUSY (bit 7) is
+            // inverted by the hardware, so the default inversion is 0x80
+            int bits[8];
+            int n_bits = 0;
+            unsigned char invert = nrhs > 3 ? (unsigned char)mxGetScalar(prhs[3]) : 0x80;
+
+            if (mxIsChar(prhs[2]))
+            {
+                mxGetString(prhs[2], option, sizeof(option));
+                if (strcmp(option, "raw") != 0)
+                    mexErrMsgTxt("Unknown decode option : vector of STATUS bits or 'raw'");
+                invert = 0;
+            }
+            else
+            {
+                n_bits = mxGetNumberOfElements(prhs[2]);
+                if (n_bits == 0 || n_bits > 8 || !mxIsDouble(prhs[2]))
+                    mexErrMsgTxt("The buttons must be given as a vector of 1 to 8 STATUS bits (0-7)");
+                for (int k = 0; k < n_bits; k++)
+                {
+                    bits[k] = (int)mxGetPr(prhs[2])[k];
+                    if (bits[k] < 0 || bits[k] > 7)
+                        mexErrMsgTxt("The STATUS bits are numbered from 0 to 7");
+                }
+            }
+            for (int j = 0; j < n; j++)
+                setDecodeTable(&pports[(int)mxGetPr(prhs[1])[j] - 1], bits, n_bits, invert);
+        }
+        break;
+
+    case 'q': // ppMEG('queue', hold_us), ppMEG('queue', 'stop') or info = ppMEG('queue')
+        if (!isAction(prhs[0], "queue"))
+            mexErrMsgTxt("No valid action specified : o / w / r / p / e / s / l / n / t / q / d / c");
+        if (nrhs == 2 && mxIsChar(prhs[1]))
+        {
+            mxGetString(prhs[1], option, sizeof(option));
+            if (strcmp(option, "stop") != 0)
+                mexErrMsgTxt("Unknown queue option : hold time in us or 'stop'");
+            // the values still queued are written (with their hold time) before returning
+            stopQueueThread(1);
+            break;
+        }
+        if (nrhs == 2)
+        {
+            width = mxGetScalar(prhs[1]);
+            if (!(width >= 0) || width > 1e6)
+                mexErrMsgTxt("The hold time must be given in us (up to 1 s)");
+            startQueueThread((uint64_t)(width * 1e3));
+            break;
+        }
+        if (nrhs != 1)
+            mexErrMsgTxt("ppMEG('queue', hold_us), ppMEG('queue', 'stop') or info = ppMEG('queue')");
+        {
+            // state of the queue, the delays between 'w' and the writes are in ppMEG('stats') (queue_delay)
+            static const char *fields[] = {"running", "hold_us", "depth", "max_depth", "written", "full"};
+            uint_fast64_t head = atomic_load(&queue_head);
+
+            plhs[0] = mxCreateStructMatrix(1, 1, sizeof(fields) / sizeof(fields[0]), fields);
+            mxSetFieldByNumber(plhs[0], 0, 0, mxCreateDoubleScalar(queue_thread_running));
+            mxSetFieldByNumber(plhs[0], 0, 1, mxCreateDoubleScalar(atomic_load(&queue_hold_ns) * 1e-3));
+            mxSetFieldByNumber(plhs[0], 0, 2, mxCreateDoubleScalar(head - atomic_load(&queue_tail)));
+            mxSetFieldByNumber(plhs[0], 0, 3, mxCreateDoubleScalar(queue_max_depth));
+            mxSetFieldByNumber(plhs[0], 0, 4, mxCreateDoubleScalar(atomic_load(&hist_queue_delay.count)));
+            mxSetFieldByNumber(plhs[0], 0, 5, mxCreateDoubleScalar(queue_full));
+        }
+        break;
+
+    case 't': // value = ppMEG('toggle', mask): the DATA bits of the mask are inverted, the others are unchanged
+              // or ppMEG('train', mask, period_us, width_us[, count]), ppMEG('train', 'stop'), info = ppMEG('train')
+        if (isAction(prhs[0], "train"))
+        {
+            if (nrhs == 2 && mxIsChar(prhs[1]))
+            {
+                mxGetString(prhs[1], option, sizeof(option));
+                if (strcmp(option, "stop") != 0)
+                    mexErrMsgTxt("Unknown train option : mask, period and width in us, or 'stop'");
+                stopTrainThread();
+                break;
+            }
+            if (nrhs == 4 || nrhs == 5)
+            {
+                double mask = mxGetScalar(prhs[1]), period = mxGetScalar(prhs[2]);
+                double count = nrhs == 5 ? mxGetScalar(prhs[4]) : 0;
+
+                width = mxGetScalar(prhs[3]);
+                if (!(mask >= 1 && mask <= 255))
+                    mexErrMsgTxt("The mask of the train must be in [1-255]");
+                if (!(period >= 1) || period > 3600e6 || !(width > 0) || width >= period)
+                    mexErrMsgTxt("The period and the width must be given in us, 0 < width < period <= 1 h");
+                if (!(count >= 0))
+                    mexErrMsgTxt("The number of pulses must be >= 0 (0 or Inf: until ppMEG('train', 'stop'))");
+                startTrainThread((unsigned char)mask, (uint64_t)(period * 1e3), (uint64_t)(width * 1e3),
+                                 isinf(count) ? 0 : (uint64_t)count);
+                break;
+            }
+            if (nrhs != 1)
+                mexErrMsgTxt("ppMEG('train', mask, period_us, width_us[, count]), ppMEG('train', 'stop') or "
+                             "info = ppMEG('train')");
+            {
+                // achieved periods: intervals between the ends of the writes of two consecutive rising edges, the
+                // lateness of each rising edge is in ppMEG('stats') (train_lateness)
+                static const char *fields[] = {"running", "mask", "period_us", "width_us", "count", "pulses",
+                                               "skipped", "period_mean_us", "period_std_us", "period_min_us",
+                                               "period_max_us"};
+                double values[sizeof(fields) / sizeof(fields[0])];
+                uint64_t n_periods;
+
+                pthread_mutex_lock(&train_mutex);
+                n_periods = train_periods;
+                values[0] = train_thread_running && atomic_load(&train_reserved) != 0;
+                values[1] = train_mask;
+                values[2] = train_period_ns * 1e-3;
+                values[3] = train_width_ns * 1e-3;
+                values[4] = train_count > 0 ? (double)train_count : mxGetInf();
+                values[5] = train_pulses;
+                values[6] = train_skipped;
+                values[7] = n_periods > 0 ? (train_period_ns + train_error_sum / n_periods) * 1e-3 : mxGetNaN();
+                values[8] = n_periods > 1 ? sqrt(fmax(0, (train_error_sum2 - train_error_sum * train_error_sum /
+                                                          n_periods) / (n_periods - 1))) * 1e-3
+                                          : mxGetNaN();
+                values[9] = n_periods > 0 ? train_period_min_ns * 1e-3 : mxGetNaN();
+                values[10] = n_periods > 0 ? train_period_max_ns * 1e-3 : mxGetNaN();
+                pthread_mutex_unlock(&train_mutex);
+
+                plhs[0] = mxCreateStructMatrix(1, 1, sizeof(fields) / sizeof(fields[0]), fields);
+                for (int k = 0; k < sizeof(fields) / sizeof(fields[0]); k++)
+                    mxSetFieldByNumber(plhs[0], 0, k, mxCreateDoubleScalar(values[k]));
+            }
+            break;
+        }
+        if (!isAction(prhs[0], "toggle"))
+            mexErrMsgTxt("No valid action specified : o / w / r / p / e / s / l / n / t / q / d / c");
+        if (nrhs != 2)
+            mexErrMsgTxt("ppMEG('toggle', mask) with mask in [0-255]");
+        message = (unsigned char)mxGetScalar(prhs[1]);
+        checkPort(modifyData(0xFF, message, writing_port_idx, &message), "PPWDATA");
+        if (nlhs > 0)
+            plhs[0] = mxCreateDoubleScalar(message);
+        break;
+
+    case 'c': // ppMEG('close'), ppMEG('clear', mask) or ppMEG('capture', ports, nsamples)
+        if (isAction(prhs[0], "capture"))
+        {
+            // [status, t] = ppMEG('capture', ports, nsamples): STATUS of the ports (1-based indices in the table)
+            // read in a tight loop, uint8 nsamples x nports, and uint64 CLOCK_MONOTONIC time (ns) at the start of
+            // each sample. The buffers are allocated once (mxMalloc, not zeroed), filled in place and handed to
+            // the outputs as they are.
+            int idx[PARPORT_MAX];
+            size_t n_samples;
+            unsigned char *status;
+            uint64_t *t;
+
+            if (nrhs != 3)
+                mexErrMsgTxt("ppMEG('capture', ports, nsamples)");
+            n = mxGetNumberOfElements(prhs[1]);
+            if (n == 0 || n > PARPORT_MAX || !mxIsDouble(prhs[1]))
+                mexErrMsgTxt("The ports must be a vector of port numbers (from 1, order of the port table)");
+            for (int j = 0; j < n; j++)
+            {
+                idx[j] = (int)mxGetPr(prhs[1])[j] - 1;
+                if (idx[j] < 0 || idx[j] >= port_count || pports[idx[j]].backend == NULL)
+                    mexErrMsgTxt("Parallel port was not opened \n");
+            }
+            width = mxGetScalar(prhs[2]);
+            if (!(width >= 1))
+                mexErrMsgTxt("The number of samples must be positive");
+            n_samples = (size_t)width;
+
+            status = mxMalloc(n_samples * n);
+            t = mxMalloc(n_samples * sizeof(uint64_t));
+            for (size_t k = 0; k < n_samples; k++)
+            {
+                t[k] = monotonicNs();
+                for (int j = 0; j < n; j++)
+                {
+                    // the buffers are freed by Matlab on error
+                    checkPort(readPort(&status[j * n_samples + k], idx[j]), "PPRSTATUS");
+                }
+            }
+            plhs[0] = adoptMatrix(status, n_samples, n, mxUINT8_CLASS);
+            if (nlhs > 1)
+                plhs[1] = adoptMatrix(t, n_samples, 1, mxUINT64_CLASS);
+            else
+                mxFree(t);
+            break;
+        }
+        if (isAction(prhs[0], "clear"))
+        {
+            // value = ppMEG('clear', mask): the DATA bits of the mask go to 0, the others are unchanged
+            if (nrhs != 2)
+                mexErrMsgTxt("ppMEG('clear', mask) with mask in [0-255]");
+            message = (unsigned char)mxGetScalar(prhs[1]);
+            checkPort(modifyData(~message, 0, writing_port_idx, &message), "PPWDATA");
+            if (nlhs > 0)
+                plhs[0] = mxCreateDoubleScalar(message);
+            break;
+        }
+        if (nrhs != 1)
+            mexErrMsgTxt("Error calling close: no argument should be given");
+        // the port table is emptied, it is rebuilt by the next 'open'
+        unloadAll();
+        break;
+
+    default:
+        mexErrMsgTxt("No valid action specified : o / w / r / p / e / s / l / n / t / q / d / c");
+    }
 }
@@ -0,0 +1,163 @@
+"""Python client of the ppMEG daemon (ppMEGd), messages in ppMEG_wire.h
+
+    from ppMEG_client import PPMEG
+    pp = PPMEG()                                 # connects to the default socket, PPMEG(socket) otherwise
+    pp('open')
+    pp('w', 3)
+    port1, port3 = pp('r', nargout=2)
+    status, t_ns = pp('capture', [1, 3], 1000, nargout=2)
+
+The arguments are converted as MATLAB would see them: numbers are doubles, bool are logicals, str are char
+arrays, lists of numbers are double row vectors, other lists are cells, dicts are 1x1 structs, bytes are uint8
+and numpy arrays keep their class. The outputs come back as numbers / str / bool for scalars and strings,
+numpy arrays (lists without numpy) otherwise, lists for cells and dicts for structs. The errors of ppMEG are
+raised as RuntimeError and the text printed by ppMEG is written on stdout.
+
+The daemon runs the calls of all its clients one at a time. A blocking call ('waitresponse', 'waituntil',
+'capture') delays the calls of every other client until it returns, e.g. pp('waitresponse', 64, 2) can hold
+the 'w' of a MATLAB client for 2 s: with several clients, follow the responses with 'events' instead.
+"""
+import os
+import socket
+import struct
+import sys
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+
+def default_socket():
+    """$XDG_RUNTIME_DIR/ppMEG.sock, or /tmp/ppMEG-<uid>/ppMEG.sock (wireDefaultPath of ppMEG_wire.h)"""
+    runtime = os.environ.get('XDG_RUNTIME_DIR', '')
+    if runtime.startswith('/'):
+        return os.path.join(runtime, 'ppMEG.sock')
+    return '/tmp/ppMEG-%d/ppMEG.sock' % os.getuid()
+
+
+CELL, STRUCT, LOGICAL, CHAR = 1, 2, 3, 4
+NUMERIC = {6: 'd', 7: 'f', 8: 'b', 9: 'B', 10: 'h', 11: 'H', 12: 'i', 13: 'I', 14: 'q', 15: 'Q'}
+NUMPY_CLASSES = {'float64': 6, 'float32': 7, 'int8': 8, 'uint8': 9, 'int16': 10, 'uint16': 11, 'int32': 12,
+                 'uint32': 13, 'int64': 14, 'uint64': 15, 'bool': LOGICAL}
+
+
+def _header(class_id, dims):
+    return struct.pack('=II%dQ' % len(dims), class_id, len(dims), *dims)
+
+
+def encode(value):
+    """One array of the wire format"""
+    if value is None:
+        return _header(6, (0, 0))
+    if isinstance(value, bool):
+        return _header(LOGICAL, (1, 1)) + struct.pack('=B', value)
+    if isinstance(value, (int, float)):
+        return _header(6, (1, 1)) + struct.pack('=d', value)
+    if isinstance(value, str):
+        return _header(CHAR, (1 if value else 0, len(value))) + value.encode('utf-16-le')
+    if isinstance(value, (bytes, bytearray)):
+        return _header(9, (1 if value else 0, len(value))) + bytes(value)
+    if isinstance(value, dict):
+        names = list(value)
+        data = _header(STRUCT, (1, 1)) + struct.pack('=I', len(names))
+        data += b''.join(struct.pack('=I', len(n)) + n.encode() for n in names)
+        return data + b''.join(encode(value[n]) for n in names)
+    if numpy is not None and isinstance(value, numpy.ndarray):
+        array = numpy.atleast_2d(value)
+        if array.dtype.name not in NUMPY_CLASSES:
+            array = array.astype('float64')
+        return _header(NUMPY_CLASSES[array.dtype.name], array.shape) + array.tobytes(order='F')
+    if isinstance(value, (list, tuple)):
+        if all(isinstance(v, (int, float)) and not isinstance(v, bool) for v in value):
+            return _header(6, (1 if value else 0, len(value))) + struct.pack('=%dd' % len(value), *value)
+        return _header(CELL, (1, len(value))) + b''.join(encode(v) for v in value)
+    raise TypeError('Cannot send %s to ppMEG' % type(value).__name__)
+
+
+class _Reader:
+    def __init__(self, data):
+        self.data = data
+        self.p = 0
+
+    def take(self, n):
+        chunk = self.data[self.p:self.p + n]
+        if len(chunk) != n:
+            raise ValueError('Malformed reply of the ppMEG daemon')
+        self.p += n
+        return chunk
+
+    def unpack(self, fmt):
+        return struct.unpack('=' + fmt, self.take(struct.calcsize('=' + fmt)))
+
+    def string(self):
+        (n,) = self.unpack('I')
+        return self.take(n).decode('utf-8', 'replace')
+
+    def array(self):
+        (class_id,) = self.unpack('I')
+        if class_id == 0:
+            return None
+        (ndims,) = self.unpack('I')
+        dims = self.unpack('%dQ' % ndims)
+        numel = 1
+        for d in dims:
+            numel *= d
+        if class_id == CELL:
+            return [self.array() for _ in range(numel)]
+        if class_id == STRUCT:
+            (n_fields,) = self.unpack('I')
+            names = [self.string() for _ in range(n_fields)]
+            elements = [{n: self.array() for n in names} for _ in range(numel)]
+            return elements[0] if numel == 1 else elements
+        if class_id == CHAR:
+            return self.take(2 * numel).decode('utf-16-le')
+        code = 'B' if class_id == LOGICAL else NUMERIC[class_id]
+        raw = self.take(numel * struct.calcsize(code))
+        if numel == 1:
+            value = struct.unpack('=' + code, raw)[0]
+            return bool(value) if class_id == LOGICAL else value
+        if numpy is not None:
+            dtype = 'bool' if class_id == LOGICAL else numpy.dtype('=' + code)
+            return numpy.frombuffer(raw, dtype=dtype).reshape(dims, order='F')
+        values = list(struct.unpack('=%d%s' % (numel, code), raw))
+        return [bool(v) for v in values] if class_id == LOGICAL else values
+
+
+class PPMEG:
+    def __init__(self, path=None):
+        self.socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        path = default_socket() if path is None else path
+        self.socket.connect(path)
+
+    def __call__(self, *args, nargout=1):
+        payload = struct.pack('=ii', nargout, len(args)) + b''.join(encode(a) for a in args)
+        self.socket.sendall(struct.pack('=I', len(payload)) + payload)
+        reader = _Reader(self._receive())
+        (status,) = reader.unpack('i')
+        text = reader.string()
+        if text:
+            sys.stdout.write(text)
+        if status != 0:
+            raise RuntimeError(reader.string().strip())
+        (n,) = reader.unpack('i')
+        outputs = [reader.array() for _ in range(n)]
+        if nargout <= 1:
+            return outputs[0] if outputs else None
+        return tuple(outputs[:nargout])
+
+    def _receive(self):
+        (size,) = struct.unpack('=I', self._receive_all(4))
+        return self._receive_all(size)
+
+    def _receive_all(self, n):
+        data = bytearray()
+        while len(data) < n:
+            chunk = self.socket.recv(n - len(data))
+            if not chunk:
+                raise ConnectionError('The ppMEG daemon closed the connection')
+            data += chunk
+        return bytes(data)
+
+    def close(self):
+        self.socket.close()
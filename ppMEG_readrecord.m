@@ -0,0 +1,71 @@
+function [t, port, reg, value, run, info] = ppMEG_readrecord(filename)
+%PPMEG_READRECORD Decode a file written by ppMEG('record', filename)
+%
+%   [t, port, reg, value, run, info] = ppMEG_readrecord(filename)
+%
+%   One row per change of the pins (the first rows give the initial state of each port):
+%     t     : time of the change in s (CLOCK_MONOTONIC, same clock as ppMEG('now'))
+%     port  : port number, from 1 in the order of the port table
+%     reg   : 0 for the STATUS pins (response ports), 1 for the DATA pins (trigger port)
+%     value : new value of the pins
+%     run   : number of samples of the previous value of the same pins (the runs longer than 2^32 - 1
+%             samples, split in the file, are added up)
+%     info  : header of the file (start time, number of ports, trigger port)
+%
+%   The file can be read while it is recorded, or after a crash of Matlab: only the records counted in the
+%   header are decoded.
+
+header_size = 4096;
+record_size = 16;
+
+fid = fopen(filename, 'r', 'ieee-le');
+if fid < 0
+    error('ppMEG_readrecord:open', 'Cannot open %s', filename);
+end
+cleanup = onCleanup(@() fclose(fid));
+
+magic = fread(fid, [1 8], '*char');
+if ~strcmp(magic, 'PPMEGREC')
+    error('ppMEG_readrecord:format', '%s is not a ppMEG record file', filename);
+end
+info.version = fread(fid, 1, 'uint32');
+if fread(fid, 1, 'uint32') ~= record_size
+    error('ppMEG_readrecord:format', 'Unknown record size in %s', filename);
+end
+info.t_start = double(fread(fid, 1, '*uint64')) * 1e-9;
+n = double(fread(fid, 1, '*uint64'));
+info.n_ports = fread(fid, 1, 'uint32');
+info.writing_port = fread(fid, 1, 'uint32');
+
+fseek(fid, header_size, 'bof');
+raw = fread(fid, [record_size, n], '*uint8');
+n = size(raw, 2); % the file may be shorter if it was cut while being written
+
+t = double(typecast(reshape(raw(1:8, :), [], 1), 'uint64')) * 1e-9;
+run = double(typecast(reshape(raw(9:12, :), [], 1), 'uint32'));
+port = double(raw(13, :)');
+reg = double(raw(14, :)');
+value = double(raw(15, :)');
+
+% a run reaching intmax('uint32') samples is closed in the file by a record repeating the value of the pins:
+% its run is added to the next record of the same pins and the record is dropped
+key = port * 2 + reg;
+[sorted_key, order] = sort(key); % stable: the records of each pin set stay in the order of the file
+sorted_value = value(order);
+repeat = false(n, 1);
+repeat(2:end) = sorted_key(2:end) == sorted_key(1:end-1) & sorted_value(2:end) == sorted_value(1:end-1);
+for p = find(repeat)'
+    if p < n && sorted_key(p + 1) == sorted_key(p)
+        run(order(p + 1)) = run(order(p + 1)) + run(order(p));
+    end
+end
+keep = true(n, 1);
+keep(order(repeat)) = false;
+t = t(keep);
+run = run(keep);
+port = port(keep);
+reg = reg(keep);
+value = value(keep);
+n = sum(keep);
+info.n_records = n;
+end
@@ -0,0 +1,103 @@
+/** Layout of the shared-memory event ring published by ppMEG('share', name)
+ *
+ * The triggers written on the DATA pins and the changes of the STATUS pins seen by the events thread are
+ * published in a POSIX shared-memory object (/dev/shm/<name>), so that other processes of the stimulus PC
+ * (eye-tracker bridge, online decoding, ...) can follow them without any system call.
+ *
+ * The object is a header page followed by PPMEG_SHM_CAPACITY fixed-size records, little-endian:
+ *
+ *   offset  header                    offset  record (24 bytes)
+ *        0  char     magic[8]              0  uint64  seq
+ *        8  uint32   version               8  uint64  t_ns
+ *       12  uint32   record_size          16  uint8   kind (PPMEG_SHM_RESPONSE / PPMEG_SHM_TRIGGER)
+ *       16  uint32   capacity             17  uint8   port (from 1, order of the port table)
+ *       20  uint32   n_ports              18  uint8   old_value
+ *       24  uint32   writing_port         19  uint8   value
+ *       28  uint32   reserved             20  uint32  reserved
+ *       32  uint64   t_start_ns
+ *       40  uint64   head
+ *
+ * Every time is CLOCK_MONOTONIC in ns, the clock of ppMEG('now'). The record number n (from 0) is stored in the
+ * slot n % capacity. head is the number of records claimed by the writers. The seq of a slot is 2n+1 while the
+ * record n is written and 2n+2 once it is complete (per-record seqlock): a reader copies the record between two
+ * reads of seq and keeps the copy only if both are 2n+2. A larger seq means that the reader is more than
+ * capacity records late and that the record was overwritten: the writers never wait for the readers, any number
+ * of readers can follow the ring. ppMEGShmRead() below is the reference implementation of a reader.
+ * */
+#ifndef PPMEG_SHM_H
+#define PPMEG_SHM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define PPMEG_SHM_MAGIC "PPMEGSHM"
+#define PPMEG_SHM_VERSION 1
+#define PPMEG_SHM_HEADER_SIZE 4096
+#define PPMEG_SHM_CAPACITY 65536 // must be a power of 2
+
+#define PPMEG_SHM_RESPONSE 0 // change of the STATUS pins of a response port (decoded value, events thread)
+#define PPMEG_SHM_TRIGGER 1  // write of the DATA pins of the trigger port
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t capacity;
+    uint32_t n_ports;      // size of the port table
+    uint32_t writing_port; // trigger port (from 1), 0 if none
+    uint32_t reserved;
+    uint64_t t_start_ns;   // CLOCK_MONOTONIC time of the creation of the ring
+    _Atomic uint64_t head; // records claimed so far (number of the next record)
+} PPMEGShmHeader;
+
+typedef struct
+{
+    _Atomic uint64_t seq; // 2n+1 while the record n is written, 2n+2 once complete
+    uint64_t t_ns;        // time of the read that saw the change, or end of the write of the trigger
+    uint8_t kind;
+    uint8_t port;
+    uint8_t old_value;
+    uint8_t value;
+    uint32_t reserved;
+} PPMEGShmRecord;
+
+typedef struct
+{
+    uint64_t t_ns;
+    uint8_t kind;
+    uint8_t port;
+    uint8_t old_value;
+    uint8_t value;
+} PPMEGShmEvent;
+
+static inline PPMEGShmRecord *ppMEGShmRecords(const PPMEGShmHeader *header)
+{
+    return (PPMEGShmRecord *)((char *)header + PPMEG_SHM_HEADER_SIZE);
+}
+
+/**
+ * Copy the record number n of the ring
+ *
+ * Returns 0 if *event is the record n, 1 if it is not complete yet (retry later), -1 if it was overwritten
+ * (the reader is more than capacity records late, it should start again from head).
+ * */
+static inline int ppMEGShmRead(const PPMEGShmHeader *header, uint64_t n, PPMEGShmEvent *event)
+{
+    PPMEGShmRecord *record = &ppMEGShmRecords(header)[n & (header->capacity - 1)];
+    uint64_t seq = atomic_load_explicit(&record->seq, memory_order_acquire);
+
+    if (seq < 2 * n + 2)
+        return 1;
+    if (seq > 2 * n + 2)
+        return -1;
+    event->t_ns = record->t_ns;
+    event->kind = record->kind;
+    event->port = record->port;
+    event->old_value = record->old_value;
+    event->value = record->value;
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&record->seq, memory_order_relaxed) == seq ? 0 : -1;
+}
+
+#endif
@@ -0,0 +1,79 @@
+/** Reference reader of the shared-memory event ring of ppMEG (ppMEG('share', name), layout in ppMEG_shm.h)
+ *
+ *   gcc -std=gnu11 -O2 ppMEG_shm_reader.c -o ppMEG_shm_reader -lrt
+ *   ./ppMEG_shm_reader [/ppMEG]
+ *
+ * Prints one line per trigger / event published after the start of the reader: time (s, CLOCK_MONOTONIC),
+ * kind, port, old and new value. The ring is read without system calls; when it is empty, the reader sleeps
+ * for READER_IDLE_NS (a consumer that needs the lowest delay can spin instead).
+ * */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "ppMEG_shm.h"
+
+#define READER_IDLE_NS 50000
+
+int main(int argc, char *argv[])
+{
+    const char *name = argc > 1 ? argv[1] : "/ppMEG";
+    size_t size = PPMEG_SHM_HEADER_SIZE + PPMEG_SHM_CAPACITY * sizeof(PPMEGShmRecord);
+    const struct timespec idle = {0, READER_IDLE_NS};
+    PPMEGShmHeader *header;
+    PPMEGShmEvent event;
+    uint64_t n;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        perror(name);
+        return 1;
+    }
+    header = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+    if (memcmp(header->magic, PPMEG_SHM_MAGIC, sizeof(header->magic)) != 0 || header->version != PPMEG_SHM_VERSION ||
+        header->record_size != sizeof(PPMEGShmRecord) || header->capacity != PPMEG_SHM_CAPACITY)
+    {
+        fprintf(stderr, "%s is not a ppMEG event ring (version %d)\n", name, PPMEG_SHM_VERSION);
+        return 1;
+    }
+    printf("%s : %u ports, trigger port %u\n", name, header->n_ports, header->writing_port);
+
+    n = atomic_load_explicit(&header->head, memory_order_acquire);
+    for (;;)
+    {
+        switch (ppMEGShmRead(header, n, &event))
+        {
+        case 0:
+            printf("%.6f %-8s port %u : %3u -> %3u\n", event.t_ns * 1e-9,
+                   event.kind == PPMEG_SHM_TRIGGER ? "trigger" : "response", event.port, event.old_value,
+                   event.value);
+            fflush(stdout);
+            n++;
+            break;
+        case 1:
+            nanosleep(&idle, NULL);
+            break;
+        default:
+        {
+            // overwritten: restart from the oldest record that is still in the ring
+            uint64_t head = atomic_load_explicit(&header->head, memory_order_acquire);
+            uint64_t restart = head > PPMEG_SHM_CAPACITY / 2 ? head - PPMEG_SHM_CAPACITY / 2 : 0;
+
+            fprintf(stderr, "%llu records lost\n", (unsigned long long)(restart - n));
+            n = restart;
+            break;
+        }
+        }
+    }
+}
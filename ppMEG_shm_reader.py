@@ -0,0 +1,77 @@
+"""Reference Python reader of the shared-memory event ring of ppMEG (ppMEG('share', name), layout in ppMEG_shm.h)
+
+    python3 ppMEG_shm_reader.py [/ppMEG]
+
+or, from another program:
+
+    ring = PPMEGShmReader('/ppMEG')
+    for t_ns, kind, port, old, new in ring.read():    # every record published since the last call
+        ...
+
+The ring is read directly in the mapping, without system calls. The seq of a record is read before and after
+its fields, the copy is only kept if both are 2n+2 (the order of the loads is the one of the CPU: x86 keeps it,
+use the C reader on weakly-ordered CPUs).
+"""
+import mmap
+import struct
+import sys
+import time
+
+HEADER = struct.Struct('<8sIIIIII QQ')
+RECORD = struct.Struct('<QQBBBBI')
+HEADER_SIZE = 4096
+MAGIC = b'PPMEGSHM'
+VERSION = 1
+HEAD_OFFSET = 40
+
+RESPONSE = 0
+TRIGGER = 1
+
+
+class PPMEGShmReader:
+    def __init__(self, name='/ppMEG', from_start=False):
+        with open('/dev/shm/' + name.lstrip('/'), 'rb') as f:
+            self.map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        magic, version, record_size, self.capacity, self.n_ports, self.writing_port, _, self.t_start_ns, head = \
+            HEADER.unpack_from(self.map, 0)
+        if magic != MAGIC or version != VERSION or record_size != RECORD.size:
+            raise ValueError('%s is not a ppMEG event ring (version %d)' % (name, VERSION))
+        self.next = 0 if from_start else head
+        self.lost = 0
+
+    def head(self):
+        return struct.unpack_from('<Q', self.map, HEAD_OFFSET)[0]
+
+    def read(self):
+        """Returns the complete records since the last call: list of (t_ns, kind, port, old_value, value)"""
+        events = []
+        while True:
+            offset = HEADER_SIZE + (self.next & (self.capacity - 1)) * RECORD.size
+            seq, t_ns, kind, port, old_value, value, _ = RECORD.unpack_from(self.map, offset)
+            expected = 2 * self.next + 2
+            if seq < expected:
+                return events
+            if seq == expected and struct.unpack_from('<Q', self.map, offset)[0] == seq:
+                events.append((t_ns, kind, port, old_value, value))
+                self.next += 1
+                continue
+            # overwritten: restart from the oldest record that is still in the ring
+            restart = max(self.head() - self.capacity // 2, self.next)
+            self.lost += restart - self.next
+            self.next = restart
+
+    def close(self):
+        self.map.close()
+
+
+if __name__ == '__main__':
+    name = sys.argv[1] if len(sys.argv) > 1 else '/ppMEG'
+    ring = PPMEGShmReader(name)
+    print('%s : %d ports, trigger port %d' % (name, ring.n_ports, ring.writing_port))
+    while True:
+        events = ring.read()
+        for t_ns, kind, port, old_value, value in events:
+            print('%.6f %-8s port %d : %3d -> %3d' % (t_ns * 1e-9, 'trigger' if kind == TRIGGER else 'response',
+                                                       port, old_value, value), flush=True)
+        if not events:
+            time.sleep(50e-6)
@@ -0,0 +1,368 @@
+/** Messages between ppMEG (MEX, Python, ... clients) and the ppMEG daemon (ppMEGd), over a Unix domain socket
+ *
+ * A call of ppMEG is sent as its arguments, the daemon runs it and sends back the outputs, the text printed
+ * during the call and the error, if any. Byte order and sizes are the ones of the machine (the socket is local).
+ *
+ *   message : uint32 size of the payload, then the payload
+ *   request : int32 nlhs, int32 nrhs, then nrhs arrays
+ *   reply   : int32 status, string printed, then if status == 0: int32 n, n arrays; else: string error message
+ *   string  : uint32 length, then the characters (no terminating 0)
+ *   array   : uint32 class, uint32 ndims, uint64 dims[ndims], then
+ *               numeric, char, logical : the elements, column-major (char: uint16, logical: uint8)
+ *               cell                   : numel arrays
+ *               struct                 : uint32 nfields, nfields strings (names), numel x nfields arrays
+ *                                        (all the fields of the first element, then of the second, ...)
+ *             class is the mxClassID of MATLAB: 1 cell, 2 struct, 3 logical, 4 char, 6 double, 7 single,
+ *             8 int8, 9 uint8, 10 int16, 11 uint16, 12 int32, 13 uint32, 14 int64, 15 uint64;
+ *             0 (without ndims nor data) is an element of a cell or a struct that was never set.
+ *
+ * Complex, sparse and other arrays (objects, function handles, ...) cannot be sent, the names of the fields are
+ * limited to WIRE_MAX_NAME - 1 characters and the structs to WIRE_MAX_FIELDS fields.
+ * */
+#ifndef PPMEG_WIRE_H
+#define PPMEG_WIRE_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "matrix.h"
+
+#define PPMEG_SOCKET_NAME "ppMEG.sock" // in $XDG_RUNTIME_DIR, or in /tmp/ppMEG-<uid>/ (see wireDefaultPath)
+#define WIRE_MAX_MESSAGE (1u << 30)
+#define WIRE_MAX_DEPTH 32 // nesting of cells / structs
+#define WIRE_MAX_DIMS 32
+#define WIRE_MAX_FIELDS 64
+#define WIRE_MAX_NAME 64 // namelengthmax of MATLAB + 1
+
+typedef struct
+{
+    char *data;
+    size_t size; // bytes used, the first 4 are the size of the message
+    size_t capacity;
+} WireBuffer;
+
+typedef struct
+{
+    const char *p;
+    const char *end;
+} WireReader;
+
+/**
+ * Default path of the socket: $XDG_RUNTIME_DIR/ppMEG.sock, or /tmp/ppMEG-<uid>/ppMEG.sock without a runtime
+ * directory (the daemon creates that directory with mode 0700: the other users cannot reach the socket)
+ *
+ * Returns 0, or ENAMETOOLONG if the path does not fit in size bytes.
+ * */
+static inline int wireDefaultPath(char *path, size_t size)
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    int n;
+
+    if (dir != NULL && dir[0] == '/')
+        n = snprintf(path, size, "%s/%s", dir, PPMEG_SOCKET_NAME);
+    else
+        n = snprintf(path, size, "/tmp/ppMEG-%u/%s", (unsigned)getuid(), PPMEG_SOCKET_NAME);
+    return n < 0 || (size_t)n >= size ? ENAMETOOLONG : 0;
+}
+
+/**
+ * Start a message in the buffer (its memory is kept from one message to the next)
+ * */
+static inline void wireBegin(WireBuffer *buffer)
+{
+    buffer->size = sizeof(uint32_t);
+}
+
+static inline int wirePut(WireBuffer *buffer, const void *src, size_t n)
+{
+    if (buffer->size + n > buffer->capacity)
+    {
+        size_t capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+        char *data;
+
+        while (capacity < buffer->size + n)
+            capacity *= 2;
+        if (capacity > WIRE_MAX_MESSAGE + sizeof(uint32_t))
+            return EMSGSIZE;
+        data = realloc(buffer->data, capacity);
+        if (data == NULL)
+            return ENOMEM;
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, src, n);
+    buffer->size += n;
+    return 0;
+}
+
+static inline int wirePutInt(WireBuffer *buffer, int32_t value)
+{
+    return wirePut(buffer, &value, sizeof(value));
+}
+
+static inline int wirePutString(WireBuffer *buffer, const char *str, size_t n)
+{
+    uint32_t length = n;
+    int err = wirePut(buffer, &length, sizeof(length));
+
+    return err ? err : wirePut(buffer, str, n);
+}
+
+/**
+ * Append an array (NULL for an element that was never set)
+ *
+ * Returns 0, EINVAL if the array cannot be sent, or the error of wirePut.
+ * */
+static inline int wirePutArray(WireBuffer *buffer, const mxArray *array, int depth)
+{
+    uint32_t header[2] = {0, 0};
+    size_t numel;
+    int err, n_fields;
+
+    if (array == NULL)
+        return wirePut(buffer, header, sizeof(header[0]));
+    header[0] = mxGetClassID(array);
+    if (header[0] == mxUNKNOWN_CLASS || header[0] == mxVOID_CLASS || header[0] > mxUINT64_CLASS ||
+        mxIsComplex(array) || mxIsSparse(array) || depth > WIRE_MAX_DEPTH)
+        return EINVAL;
+    header[1] = mxGetNumberOfDimensions(array);
+    if ((err = wirePut(buffer, header, sizeof(header))) != 0)
+        return err;
+    for (uint32_t k = 0; k < header[1]; k++)
+    {
+        uint64_t dim = mxGetDimensions(array)[k];
+        if ((err = wirePut(buffer, &dim, sizeof(dim))) != 0)
+            return err;
+    }
+
+    numel = mxGetNumberOfElements(array);
+    switch (header[0])
+    {
+    case mxCELL_CLASS:
+        for (size_t k = 0; k < numel; k++)
+            if ((err = wirePutArray(buffer, mxGetCell(array, k), depth + 1)) != 0)
+                return err;
+        return 0;
+    case mxSTRUCT_CLASS:
+        n_fields = mxGetNumberOfFields(array);
+        if ((err = wirePut(buffer, &n_fields, sizeof(uint32_t))) != 0)
+            return err;
+        for (int f = 0; f < n_fields; f++)
+        {
+            const char *name = mxGetFieldNameByNumber(array, f);
+            if ((err = wirePutString(buffer, name, strlen(name))) != 0)
+                return err;
+        }
+        for (size_t k = 0; k < numel; k++)
+            for (int f = 0; f < n_fields; f++)
+                if ((err = wirePutArray(buffer, mxGetFieldByNumber(array, k, f), depth + 1)) != 0)
+                    return err;
+        return 0;
+    default:
+        return wirePut(buffer, mxGetData(array), numel * mxGetElementSize(array));
+    }
+}
+
+static inline int wireGet(WireReader *reader, void *dst, size_t n)
+{
+    if ((size_t)(reader->end - reader->p) < n)
+        return EPROTO;
+    memcpy(dst, reader->p, n);
+    reader->p += n;
+    return 0;
+}
+
+static inline int wireGetInt(WireReader *reader, int32_t *value)
+{
+    return wireGet(reader, value, sizeof(*value));
+}
+
+/**
+ * Point to a string of the message: *str is not terminated, it is valid as long as the buffer
+ * */
+static inline int wireGetString(WireReader *reader, const char **str, size_t *n)
+{
+    uint32_t length;
+    int err = wireGet(reader, &length, sizeof(length));
+
+    if (err)
+        return err;
+    if ((size_t)(reader->end - reader->p) < length)
+        return EPROTO;
+    *str = reader->p;
+    *n = length;
+    reader->p += length;
+    return 0;
+}
+
+/**
+ * Read an array (*array is NULL for an element that was never set)
+ *
+ * Returns 0 or EPROTO if the message is malformed (nothing is left allocated then).
+ * */
+static inline int wireGetArray(WireReader *reader, mxArray **array, int depth)
+{
+    uint32_t header[2];
+    uint64_t dims64[WIRE_MAX_DIMS];
+    mwSize dims[WIRE_MAX_DIMS];
+    size_t numel = 1, bytes;
+    int err;
+
+    *array = NULL;
+    if ((err = wireGet(reader, header, sizeof(header[0]))) != 0 || header[0] == mxUNKNOWN_CLASS)
+        return err;
+    if (header[0] == mxVOID_CLASS || header[0] > mxUINT64_CLASS || depth > WIRE_MAX_DEPTH ||
+        (err = wireGet(reader, &header[1], sizeof(header[1]))) != 0 || header[1] < 2 || header[1] > WIRE_MAX_DIMS ||
+        (err = wireGet(reader, dims64, header[1] * sizeof(uint64_t))) != 0)
+        return EPROTO;
+    for (uint32_t k = 0; k < header[1]; k++)
+    {
+        if (numel > 0 && dims64[k] > SIZE_MAX / numel)
+            return EPROTO;
+        dims[k] = dims64[k];
+        numel *= dims64[k];
+    }
+    // every element takes at least one byte of the message
+    if (numel > (size_t)(reader->end - reader->p))
+        return EPROTO;
+
+    switch (header[0])
+    {
+    case mxCELL_CLASS:
+        *array = mxCreateCellArray(header[1], dims);
+        for (size_t k = 0; k < numel; k++)
+        {
+            mxArray *element;
+            if ((err = wireGetArray(reader, &element, depth + 1)) != 0)
+                break;
+            mxSetCell(*array, k, element);
+        }
+        break;
+    case mxSTRUCT_CLASS:
+    {
+        uint32_t n_fields;
+        const char *names[WIRE_MAX_FIELDS];
+        char name_buffer[WIRE_MAX_FIELDS][WIRE_MAX_NAME];
+
+        if (wireGet(reader, &n_fields, sizeof(n_fields)) != 0 || n_fields > WIRE_MAX_FIELDS)
+            return EPROTO;
+        for (uint32_t f = 0; f < n_fields; f++)
+        {
+            const char *name;
+            size_t n;
+            if (wireGetString(reader, &name, &n) != 0 || n == 0 || n >= sizeof(name_buffer[f]))
+                return EPROTO;
+            memcpy(name_buffer[f], name, n);
+            name_buffer[f][n] = '\0';
+            names[f] = name_buffer[f];
+        }
+        if (n_fields > 0 && numel > (size_t)(reader->end - reader->p) / (n_fields * sizeof(uint32_t)))
+            return EPROTO;
+        *array = mxCreateStructArray(header[1], dims, n_fields, names);
+        for (size_t k = 0; k < numel && err == 0; k++)
+        {
+            for (uint32_t f = 0; f < n_fields; f++)
+            {
+                mxArray *element;
+                if ((err = wireGetArray(reader, &element, depth + 1)) != 0)
+                    break;
+                mxSetFieldByNumber(*array, k, f, element);
+            }
+        }
+        break;
+    }
+    default:
+        if (header[0] == mxCHAR_CLASS)
+            *array = mxCreateCharArray(header[1], dims);
+        else if (header[0] == mxLOGICAL_CLASS)
+            *array = mxCreateLogicalArray(header[1], dims);
+        else
+            *array = mxCreateNumericArray(header[1], dims, header[0], mxREAL);
+        bytes = numel * mxGetElementSize(*array);
+        err = wireGet(reader, mxGetData(*array), bytes);
+        break;
+    }
+    if (err != 0)
+    {
+        mxDestroyArray(*array);
+        *array = NULL;
+    }
+    return err;
+}
+
+/**
+ * Send the message of the buffer (one write, unless the socket is full)
+ *
+ * Returns 0 or an errno (EPIPE if the other side is gone, without SIGPIPE).
+ * */
+static inline int wireSend(int fd, WireBuffer *buffer)
+{
+    uint32_t size = buffer->size - sizeof(uint32_t);
+    size_t sent = 0;
+
+    memcpy(buffer->data, &size, sizeof(size));
+    while (sent < buffer->size)
+    {
+        ssize_t n = send(fd, buffer->data + sent, buffer->size - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return errno;
+        sent += n;
+    }
+    return 0;
+}
+
+static inline int wireRecvAll(int fd, char *dst, size_t size)
+{
+    size_t received = 0;
+
+    while (received < size)
+    {
+        ssize_t n = recv(fd, dst + received, size - received, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return errno;
+        if (n == 0)
+            return ECONNRESET;
+        received += n;
+    }
+    return 0;
+}
+
+/**
+ * Receive a message in the buffer, the reader is set on its payload
+ *
+ * Returns 0 or an errno (ECONNRESET if the other side closed the connection).
+ * */
+static inline int wireReceive(int fd, WireBuffer *buffer, WireReader *reader)
+{
+    uint32_t size;
+    int err;
+
+    if ((err = wireRecvAll(fd, (char *)&size, sizeof(size))) != 0)
+        return err;
+    if (size > WIRE_MAX_MESSAGE)
+        return EMSGSIZE;
+    if (buffer->capacity < sizeof(uint32_t) + size)
+    {
+        char *data = realloc(buffer->data, sizeof(uint32_t) + size);
+        if (data == NULL)
+            return ENOMEM;
+        buffer->data = data;
+        buffer->capacity = sizeof(uint32_t) + size;
+    }
+    if ((err = wireRecvAll(fd, buffer->data + sizeof(uint32_t), size)) != 0)
+        return err;
+    buffer->size = sizeof(uint32_t) + size;
+    reader->p = buffer->data + sizeof(uint32_t);
+    reader->end = reader->p + size;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,297 @@
+/** ppMEG daemon: owns the parallel ports and runs the calls of ppMEG for its clients
+ *
+ * ppMEG.c is compiled in the daemon, with the MEX API replaced by the stub of mexstub/ (MATLAB is not needed):
+ *   gcc -std=gnu11 -O2 -Imexstub ppMEGd.c -o ppMEGd -lpthread -lm -lrt
+ *   ./ppMEGd [-s socket] [-p priority] [-c cpu] [-l]
+ *
+ * The clients connect to the Unix domain socket (wireDefaultPath by default) with ppMEG('connect') from
+ * MATLAB / Octave, or with ppMEG_client.py, and send ordinary ppMEG calls (messages in ppMEG_wire.h). The calls
+ * of all the clients are run one at a time by the main thread of the daemon, in their order of arrival. The
+ * threads of ppMEG ('schedule', 'queue', 'pulse', 'events', 'record', ...) run in the daemon: the pauses of
+ * MATLAB (JIT, garbage collection, graphics) do not delay them. The ports stay open when the clients disconnect
+ * or clear the MEX file, until ppMEG('close') or the end of the daemon (SIGINT / SIGTERM).
+ *
+ * -p and -c set the SCHED_FIFO priority and the CPU of the main thread (it runs the writes of 'w') and are the
+ * default of ppMEG('rtconfig') for the threads of ppMEG. -l locks the memory of the daemon (mlockall).
+ * A client must send its messages at once: the daemon reads a whole message before serving the next client.
+ * A blocking call ('waitresponse', 'waituntil', 'capture') holds the main thread for its whole duration and the
+ * calls of the other clients wait for it (head-of-line blocking): the clients should use them only when they are
+ * alone, and 'events' / 'rule' / 'schedule' otherwise.
+ *
+ * Only the user of the daemon (and root) can use it: the socket has mode 0600, the default one is in a directory
+ * of mode 0700, and the uid of each client is checked (SO_PEERCRED). The clients do not name the files of the
+ * daemon: 'record' creates a new file (no link followed) in the directory of the socket, 'share' a new object.
+ * */
+#define PPMEG_DAEMON
+#include "ppMEG.c" /* first: it sets _GNU_SOURCE */
+#include <getopt.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#define DAEMON_MAX_CLIENTS 16
+#define DAEMON_MAX_ARGS 32
+
+static volatile sig_atomic_t daemon_quit = 0;
+static WireBuffer call_output; // text printed by ppMEG during the call, sent to the client
+
+static void onSignal(int sig)
+{
+    (void)sig;
+    daemon_quit = 1;
+}
+
+static void collectOutput(const char *text, size_t n)
+{
+    wirePut(&call_output, text, n);
+}
+
+/**
+ * Receive a call from a client, run it and send the reply
+ *
+ * Returns 0, or an errno if the connection must be closed (ECONNRESET when the client is gone).
+ * */
+static int serveCall(int fd, WireBuffer *buffer)
+{
+    mxArray *prhs[DAEMON_MAX_ARGS] = {NULL}, *plhs[DAEMON_MAX_ARGS] = {NULL};
+    WireReader reader;
+    int32_t nlhs, nrhs;
+    int n_outputs = 0, failed, err;
+
+    if ((err = wireReceive(fd, buffer, &reader)) != 0)
+        return err;
+    if (wireGetInt(&reader, &nlhs) != 0 || wireGetInt(&reader, &nrhs) != 0 || nlhs < 0 || nlhs > DAEMON_MAX_ARGS ||
+        nrhs < 0 || nrhs > DAEMON_MAX_ARGS)
+        return EPROTO;
+    for (int k = 0; k < nrhs && err == 0; k++)
+        err = wireGetArray(&reader, &prhs[k], 0);
+
+    if (err == 0)
+    {
+        wireBegin(&call_output);
+        failed = mexStubCall(nlhs, plhs, nrhs, (const mxArray **)prhs) != 0;
+
+        // the outputs of a failed call are dropped, as in Matlab
+        wireBegin(buffer);
+        err = wirePutInt(buffer, failed);
+        if (err == 0)
+            err = wirePutString(buffer, call_output.size > sizeof(uint32_t) ? call_output.data + sizeof(uint32_t) : "",
+                                call_output.size - sizeof(uint32_t));
+        if (failed && err == 0)
+            err = wirePutString(buffer, mex_stub_error, strlen(mex_stub_error));
+        for (int k = 0; k < DAEMON_MAX_ARGS && !failed; k++)
+            if (plhs[k] != NULL)
+                n_outputs = k + 1;
+        if (!failed && err == 0)
+            err = wirePutInt(buffer, n_outputs);
+        for (int k = 0; k < n_outputs && err == 0; k++)
+            err = wirePutArray(buffer, plhs[k], 0);
+        if (err == 0)
+            err = wireSend(fd, buffer);
+    }
+    for (int k = 0; k < DAEMON_MAX_ARGS; k++)
+    {
+        mxDestroyArray(prhs[k]);
+        mxDestroyArray(plhs[k]);
+    }
+    return err;
+}
+
+/**
+ * Keep the directory of the socket in daemon_dir, created if needed (mode 0700) if it must be private
+ *
+ * A private directory (the one of the default socket) must belong to the user of the daemon and be closed to the
+ * other users, a directory of -s is used as it is.
+ * */
+static int socketDirectory(const char *path, int private)
+{
+    const char *slash = strrchr(path, '/');
+    struct stat info;
+
+    if (slash == NULL)
+        snprintf(daemon_dir, sizeof(daemon_dir), ".");
+    else
+        snprintf(daemon_dir, sizeof(daemon_dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+    if (!private)
+        return 0;
+    if (mkdir(daemon_dir, 0700) < 0 && errno != EEXIST)
+    {
+        perror(daemon_dir);
+        return -1;
+    }
+    if (lstat(daemon_dir, &info) < 0 || !S_ISDIR(info.st_mode) || info.st_uid != geteuid() ||
+        (info.st_mode & 077) != 0)
+    {
+        fprintf(stderr, "ppMEGd: %s must be a directory of the user of the daemon, mode 0700\n", daemon_dir);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Is the client the user of the daemon (or root)?
+ * */
+static int trustedClient(int fd)
+{
+    struct ucred peer;
+    socklen_t length = sizeof(peer);
+
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) == 0 && (peer.uid == geteuid() || peer.uid == 0);
+}
+
+/**
+ * Create the listening socket (mode 0600), unless another daemon already serves it (a stale socket file is
+ * replaced)
+ * */
+static int listenSocket(const char *path)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    mode_t mask;
+    int fd, err;
+
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "ppMEGd: the path of the socket is too long\n");
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0)
+    {
+        fprintf(stderr, "ppMEGd: another daemon is listening on %s\n", path);
+        close(fd);
+        return -1;
+    }
+    if (fd >= 0)
+        close(fd);
+    unlink(path);
+
+    // the mode of the socket file comes from the umask at bind()
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mask = umask(0177);
+    err = fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ? errno : 0;
+    umask(mask);
+    if (err != 0 || listen(fd, DAEMON_MAX_CLIENTS) < 0)
+    {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    static char default_path[PATH_MAX];
+    const char *path = NULL;
+    struct pollfd fds[1 + DAEMON_MAX_CLIENTS];
+    struct sigaction action;
+    WireBuffer buffer = {NULL, 0, 0};
+    int n_clients = 0, lock = 0, opt;
+
+    while ((opt = getopt(argc, argv, "s:p:c:l")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            path = optarg;
+            break;
+        case 'p':
+            rt_priority = atoi(optarg);
+            break;
+        case 'c':
+            rt_cpu = atoi(optarg);
+            break;
+        case 'l':
+            lock = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s socket] [-p priority] [-c cpu] [-l]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (rt_priority > 0 || rt_cpu >= 0)
+    {
+        char msg[256] = "";
+        int ok[3] = {1, 1, 1};
+
+        applyRtSettings(pthread_self(), ok, msg, sizeof(msg));
+        if (!ok[0] || !ok[1])
+            fprintf(stderr, "ppMEGd: %s\n", msg);
+    }
+    if (lock && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        perror("ppMEGd: mlockall");
+
+    // the signals interrupt poll(), the connections are then closed and the ports released
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (path == NULL && wireDefaultPath(default_path, sizeof(default_path)) != 0)
+    {
+        fprintf(stderr, "ppMEGd: the path of the socket is too long\n");
+        return 1;
+    }
+    if (path == NULL)
+        path = default_path;
+    if (socketDirectory(path, path == default_path) < 0)
+        return 1;
+    fds[0].fd = listenSocket(path);
+    if (fds[0].fd < 0)
+        return 1;
+    fds[0].events = POLLIN;
+    mex_stub_output = collectOutput;
+    fprintf(stderr, "ppMEGd: listening on %s\n", path);
+
+    while (!daemon_quit)
+    {
+        if (poll(fds, 1 + n_clients, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("ppMEGd: poll");
+            break;
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = accept4(fds[0].fd, NULL, NULL, SOCK_CLOEXEC);
+
+            if (fd >= 0 && !trustedClient(fd))
+            {
+                fprintf(stderr, "ppMEGd: client of another user refused\n");
+                close(fd);
+            }
+            else if (fd >= 0 && n_clients == DAEMON_MAX_CLIENTS)
+                close(fd);
+            else if (fd >= 0)
+            {
+                n_clients++;
+                fds[n_clients] = (struct pollfd){.fd = fd, .events = POLLIN, .revents = 0};
+            }
+        }
+        for (int i = 1; i <= n_clients; i++)
+        {
+            int err;
+
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)) || (err = serveCall(fds[i].fd, &buffer)) == 0)
+                continue;
+            if (err != ECONNRESET)
+                fprintf(stderr, "ppMEGd: client dropped: %s\n", strerror(err));
+            close(fds[i].fd);
+            fds[i--] = fds[n_clients--];
+        }
+    }
+
+    for (int i = 1; i <= n_clients; i++)
+        close(fds[i].fd);
+    close(fds[0].fd);
+    unlink(path);
+    mex_stub_output = NULL;
+    mexStubClear();
+    free(buffer.data);
+    free(call_output.data);
+    return 0;
+}
@@ -0,0 +1,122 @@
+/** Regression tests of ppMEG on the simulated ports, outside MATLAB
+ *
+ * ppMEG.c is compiled in the same program, with the MEX API replaced by the stub of mexstub/:
+ *   gcc -std=gnu11 -O2 -Imexstub tests/ppMEG_test.c -o ppMEG_test -lpthread -lm -lrt
+ *   ./ppMEG_test
+ *
+ * Each test prints one line (ok / FAILED with the reason); the exit status is the number of failed tests.
+ * The tests check the order and the values of the writes in ppMEG('log'), the timings only with wide margins.
+ * */
+#include "../ppMEG.c"
+
+typedef struct
+{
+    int nlhs;
+    mxArray *plhs[8];
+} Outputs;
+
+static int failures = 0;
+
+/* one call of mexFunction with string / double arguments ("s" or "d" per argument), the outputs are kept */
+static void call(Outputs *out, int nlhs, const char *types, ...)
+{
+    const mxArray *prhs[8];
+    int nrhs = strlen(types);
+    va_list ap;
+
+    va_start(ap, types);
+    for (int k = 0; k < nrhs; k++)
+        prhs[k] = types[k] == 's' ? mxCreateString(va_arg(ap, const char *)) : mxCreateDoubleScalar(va_arg(ap, double));
+    va_end(ap);
+    memset(out, 0, sizeof(*out));
+    out->nlhs = nlhs;
+    if (mexStubCall(nlhs, out->plhs, nrhs, prhs) != 0)
+    {
+        fprintf(stderr, "ppMEG error: %s\n", mex_stub_error);
+        exit(100);
+    }
+    for (int k = 0; k < nrhs; k++)
+        mxDestroyArray((mxArray *)prhs[k]);
+}
+
+static void clearOutputs(Outputs *out)
+{
+    for (int k = 0; k < out->nlhs; k++)
+        mxDestroyArray(out->plhs[k]);
+}
+
+static void report(const char *name, const char *error)
+{
+    printf("%-28s %s%s\n", name, error == NULL ? "ok" : "FAILED: ", error == NULL ? "" : error);
+    failures += error != NULL;
+}
+
+/* ppMEG('pulse', 255, 8000) then ppMEG('w', 12) before the reset: 12 stays on the port */
+static void testWriteCancelsPulseReset(void)
+{
+    Outputs out;
+    const char *error = NULL;
+    size_t n;
+
+    call(&out, 0, "ss", "open", "sim");
+    call(&out, 0, "ss", "log", "reset");
+    call(&out, 1, "sdd", "pulse", 255.0, 8000.0);
+    clearOutputs(&out);
+    usleep(5000);
+    call(&out, 0, "sd", "w", 12.0);
+    usleep(10000);
+
+    call(&out, 2, "s", "log");
+    n = mxGetM(out.plhs[1]);
+    if (n != 2)
+        error = "the reset of the pulse was written after the 'w'";
+    else if (mxGetPr(out.plhs[1])[0] != 255 || mxGetPr(out.plhs[1])[1] != 12)
+        error = "unexpected values in the log";
+    clearOutputs(&out);
+    call(&out, 0, "s", "close");
+    report("write_cancels_pulse_reset", error);
+}
+
+/* a short pulse sent while the pulse thread spins on the reset of a longer one is reset on time
+   (needs 2 CPUs: on one, the spin of the caller in 'waituntil' and the one of the pulse thread take turns) */
+static void testPulseDuringSpin(void)
+{
+    Outputs out;
+    const char *error = NULL;
+    double *values, *t_after, t_high;
+
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+    {
+        printf("%-28s skipped (1 CPU)\n", "pulse_during_spin");
+        return;
+    }
+    call(&out, 0, "ss", "open", "sim");
+    call(&out, 0, "ssd", "waituntil", "margin", 2000.0); // the thread spins during the last 2 ms of a wait
+    call(&out, 0, "ss", "log", "reset");
+    call(&out, 1, "sddd", "pulse", 1.0, 3000.0, 1.0);
+    t_high = mxGetScalar(out.plhs[0]);
+    clearOutputs(&out);
+    call(&out, 0, "sd", "waituntil", t_high + 1.5e-3);
+    call(&out, 1, "sddd", "pulse", 2.0, 100.0, 2.0);
+    clearOutputs(&out);
+    usleep(5000);
+
+    call(&out, 4, "s", "log");
+    values = mxGetPr(out.plhs[1]);
+    t_after = mxGetPr(out.plhs[3]);
+    if (mxGetM(out.plhs[1]) != 4 || values[0] != 1 || values[1] != 3 || values[2] != 1 || values[3] != 0)
+        error = "unexpected writes in the log";
+    else if (t_after[2] - t_after[1] > 1e-3)
+        error = "the short pulse was reset after the deadline of the long one";
+    clearOutputs(&out);
+    call(&out, 0, "s", "close");
+    report("pulse_during_spin", error);
+}
+
+int main(void)
+{
+    mex_stub_quiet = 1;
+    testWriteCancelsPulseReset();
+    testPulseDuringSpin();
+    return failures;
+}